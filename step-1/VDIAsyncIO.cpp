@@ -0,0 +1,520 @@
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "VDIAsyncIO.h"
+
+// Largest single SQE transfer; sqe->len is 32 bits
+#define VDI_ASYNC_MAX_SEGMENT (1u << 30)
+
+static int IoUringSetup(unsigned entries, struct io_uring_params *params)
+{
+#ifdef __NR_io_uring_setup
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int IoUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+#ifdef __NR_io_uring_enter
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+bool VDIAsyncIO::Start(VDIFile *vdi, unsigned queueDepth, unsigned threads)
+{
+    this->vdi = vdi;
+    stopping = false;
+    outstanding = 0;
+    inFlight = 0;
+    ringFd = -1;
+    sqRing = cqRing = sqeArea = nullptr;
+
+    useRing = SetupRing(queueDepth);
+    if (useRing)
+    {
+        reaper = std::thread(&VDIAsyncIO::ReapLoop, this);
+        return true;
+    }
+
+    if (threads == 0)
+        threads = 1;
+    for (unsigned i = 0; i < threads; i++)
+        workers.emplace_back(&VDIAsyncIO::WorkerLoop, this);
+    return true;
+}
+
+bool VDIAsyncIO::SetupRing(unsigned queueDepth)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ringFd = IoUringSetup(queueDepth, &params);
+    if (ringFd < 0)
+        return false;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap)
+    {
+        if (cqRingSize > sqRingSize)
+            sqRingSize = cqRingSize;
+        cqRingSize = sqRingSize;
+    }
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED)
+    {
+        sqRing = nullptr;
+        TeardownRing();
+        return false;
+    }
+
+    if (singleMap)
+        cqRing = sqRing;
+    else
+    {
+        cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+        {
+            cqRing = nullptr;
+            TeardownRing();
+            return false;
+        }
+    }
+
+    sqeAreaSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqeArea = mmap(nullptr, sqeAreaSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqeArea == MAP_FAILED)
+    {
+        sqeArea = nullptr;
+        TeardownRing();
+        return false;
+    }
+
+    uint8_t *sq = reinterpret_cast<uint8_t*>(sqRing);
+    uint8_t *cq = reinterpret_cast<uint8_t*>(cqRing);
+    sqHead = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+    cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+    sqEntries = params.sq_entries;
+
+    return true;
+}
+
+void VDIAsyncIO::TeardownRing()
+{
+    if (sqeArea)
+        munmap(sqeArea, sqeAreaSize);
+    if (cqRing && cqRing != sqRing)
+        munmap(cqRing, cqRingSize);
+    if (sqRing)
+        munmap(sqRing, sqRingSize);
+    sqRing = cqRing = sqeArea = nullptr;
+
+    if (ringFd >= 0)
+    {
+        close(ringFd);
+        ringFd = -1;
+    }
+}
+
+void VDIAsyncIO::Stop()
+{
+    Wait();
+
+    if (useRing)
+    {
+        {
+            std::lock_guard<std::mutex> lock(ringLock);
+            stopping = true;
+
+            // A NOP with no segment wakes the reaper so it can see the stop flag
+            uint32_t tail = *sqTail;
+            uint32_t index = tail & *sqMask;
+            struct io_uring_sqe *sqe = reinterpret_cast<struct io_uring_sqe*>(sqeArea) + index;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_NOP;
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            IoUringEnter(ringFd, 1, 0, 0);
+        }
+        reaper.join();
+        TeardownRing();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queueLock);
+        stopping = true;
+    }
+    queueReady.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+    workers.clear();
+}
+
+bool VDIAsyncIO::QueueSegment(Segment *segment)
+{
+    uint32_t tail = *sqTail;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+        return false;
+
+    uint32_t index = tail & *sqMask;
+    struct io_uring_sqe *sqe = reinterpret_cast<struct io_uring_sqe*>(sqeArea) + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = segment->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = segment->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(segment->buf);
+    sqe->len = segment->length;
+    sqe->off = segment->fileOffset;
+    sqe->user_data = reinterpret_cast<uint64_t>(segment);
+
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool IsDirectAligned(uint64_t value)
+{
+    return value % VDI_DIRECT_ALIGNMENT == 0;
+}
+
+// Whether a direct write can go to the kernel straight from the caller's buffer
+static bool IsDirectAligned(const void *buf, const std::vector<VDISegment> &segments)
+{
+    if (!IsDirectAligned(reinterpret_cast<uintptr_t>(buf)))
+        return false;
+    for (const VDISegment &segment : segments)
+    {
+        if (!IsDirectAligned(segment.length) || (segment.fileOffset != VDI_HOLE && !IsDirectAligned(segment.fileOffset)))
+            return false;
+    }
+    return true;
+}
+
+bool VDIAsyncIO::Submit(VDIAsyncRequest *requests, int count)
+{
+    if (!vdi || stopping)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(outstandingLock);
+        outstanding += count;
+    }
+
+    if (!useRing)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueLock);
+            for (int i = 0; i < count; i++)
+                queue.push_back(requests[i]);
+        }
+        queueReady.notify_all();
+        return true;
+    }
+
+    std::vector<Pending*> finished;
+    std::vector<VDISegment> segments;
+    unsigned unsubmitted = 0;
+    VDIBufferPool *pool = vdi->GetBufferPool();
+
+    std::unique_lock<std::mutex> lock(ringLock);
+    for (int i = 0; i < count; i++)
+    {
+        VDIAsyncRequest &request = requests[i];
+
+        uint64_t length = request.count;
+        uint64_t diskSize = vdi->header->diskSize;
+        if (request.offset >= diskSize)
+            length = 0;
+        else if (length > diskSize - request.offset)
+            length = diskSize - request.offset;
+
+        // The guard reference keeps the request alive until all segments are queued
+        Pending *pending = new Pending;
+        pending->remaining = 1;
+        pending->failed = false;
+        pending->total = length;
+        pending->callback = request.callback;
+
+        if (request.write && !vdi->AllocateRange(request.offset, length))
+        {
+            pending->failed = true;
+            length = 0;
+        }
+
+        if (length > 0)
+            vdi->MapRange(request.offset, length, segments);
+        else
+            segments.clear();
+
+        // A direct write that only partly covers a sector needs a read-modify-write,
+        // which VDIFile does under its own lock
+        if (pool && request.write && !IsDirectAligned(request.buf, segments))
+        {
+            if (vdi->WriteAt(request.offset, request.buf, length) != static_cast<ssize_t>(length))
+                pending->failed = true;
+            segments.clear();
+        }
+
+        uint8_t *buf = reinterpret_cast<uint8_t*>(request.buf);
+        for (const VDISegment &segment : segments)
+        {
+            if (segment.fileOffset == VDI_HOLE)
+            {
+                memset(buf, 0, segment.length);
+                buf += segment.length;
+                continue;
+            }
+
+            for (uint64_t done = 0; done < segment.length;)
+            {
+                uint64_t chunk = segment.length - done;
+                if (chunk > VDI_ASYNC_MAX_SEGMENT)
+                    chunk = VDI_ASYNC_MAX_SEGMENT;
+
+                // Keep in-flight segments within the ring so completions cannot overflow
+                while (inFlight >= sqEntries)
+                {
+                    if (unsubmitted > 0)
+                    {
+                        IoUringEnter(ringFd, unsubmitted, 0, 0);
+                        unsubmitted = 0;
+                    }
+                    ringSpace.wait(lock);
+                }
+
+                Segment *piece = new Segment{pending, buf, static_cast<uint32_t>(chunk), request.write, segment.fileOffset + done,
+                                             vdi->GetDataDescriptor(segment.layer), nullptr, 0, 0};
+
+                if (pool && !request.write && !(IsDirectAligned(piece->fileOffset) && IsDirectAligned(chunk) &&
+                                                IsDirectAligned(reinterpret_cast<uintptr_t>(buf))))
+                {
+                    // Read whole aligned sectors into a bounce buffer; the reaper copies them out
+                    uint64_t start = piece->fileOffset & ~static_cast<uint64_t>(VDI_DIRECT_ALIGNMENT - 1);
+                    piece->skip = piece->fileOffset - start;
+                    if (chunk > pool->BufferSize() - piece->skip)
+                        chunk = pool->BufferSize() - piece->skip;
+                    piece->copyLength = chunk;
+                    piece->length = (piece->skip + chunk + VDI_DIRECT_ALIGNMENT - 1) & ~static_cast<uint64_t>(VDI_DIRECT_ALIGNMENT - 1);
+                    piece->fileOffset = start;
+                    piece->target = buf;
+                    piece->buf = reinterpret_cast<uint8_t*>(pool->Acquire());
+                    if (!piece->buf)
+                    {
+                        pending->failed = true;
+                        delete piece;
+                        buf += chunk;
+                        done += chunk;
+                        continue;
+                    }
+                }
+
+                pending->remaining++;
+                QueueSegment(piece);
+                inFlight++;
+                unsubmitted++;
+
+                buf += chunk;
+                done += chunk;
+            }
+        }
+
+        if (--pending->remaining == 0)
+            finished.push_back(pending);
+    }
+
+    if (unsubmitted > 0 && IoUringEnter(ringFd, unsubmitted, 0, 0) < 0)
+        std::cerr << "io_uring_enter failed: " << strerror(errno) << "\n";
+    lock.unlock();
+
+    for (Pending *pending : finished)
+        Complete(pending);
+    return true;
+}
+
+bool VDIAsyncIO::SubmitRead(uint64_t offset, void *buf, size_t count, VDIAsyncCallback callback)
+{
+    VDIAsyncRequest request = {false, offset, buf, count, std::move(callback)};
+    return Submit(&request, 1);
+}
+
+bool VDIAsyncIO::SubmitWrite(uint64_t offset, const void *buf, size_t count, VDIAsyncCallback callback)
+{
+    VDIAsyncRequest request = {true, offset, const_cast<void*>(buf), count, std::move(callback)};
+    return Submit(&request, 1);
+}
+
+std::future<ssize_t> VDIAsyncIO::ReadAsync(uint64_t offset, void *buf, size_t count)
+{
+    std::shared_ptr<std::promise<ssize_t>> promise = std::make_shared<std::promise<ssize_t>>();
+    std::future<ssize_t> result = promise->get_future();
+    if (!SubmitRead(offset, buf, count, [promise](ssize_t n) { promise->set_value(n); }))
+        promise->set_value(-1);
+    return result;
+}
+
+std::future<ssize_t> VDIAsyncIO::WriteAsync(uint64_t offset, const void *buf, size_t count)
+{
+    std::shared_ptr<std::promise<ssize_t>> promise = std::make_shared<std::promise<ssize_t>>();
+    std::future<ssize_t> result = promise->get_future();
+    if (!SubmitWrite(offset, buf, count, [promise](ssize_t n) { promise->set_value(n); }))
+        promise->set_value(-1);
+    return result;
+}
+
+void VDIAsyncIO::Complete(Pending *request)
+{
+    if (request->callback)
+        request->callback(request->failed ? -1 : request->total);
+    delete request;
+
+    std::lock_guard<std::mutex> lock(outstandingLock);
+    if (--outstanding == 0)
+        outstandingDone.notify_all();
+}
+
+void VDIAsyncIO::Wait()
+{
+    std::unique_lock<std::mutex> lock(outstandingLock);
+    outstandingDone.wait(lock, [this]() { return outstanding == 0; });
+}
+
+void VDIAsyncIO::ReapLoop()
+{
+    std::vector<Pending*> finished;
+
+    while (true)
+    {
+        if (IoUringEnter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        {
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << "\n";
+            break;
+        }
+
+        uint32_t head = *cqHead;
+        uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        uint32_t reaped = 0;
+
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = reinterpret_cast<struct io_uring_cqe*>(cqes) + (head & *cqMask);
+            Segment *segment = reinterpret_cast<Segment*>(cqe->user_data);
+            if (!segment)
+                continue;
+
+            int32_t result = cqe->res;
+            VDIBufferPool *pool = vdi->GetBufferPool();
+            if (pool && result >= 0 && static_cast<uint32_t>(result) < segment->length)
+            {
+                // Direct transfers only come up short at the end of the file, and
+                // cannot be resumed at an unaligned offset
+                if (segment->write)
+                    segment->request->failed = true;
+                else
+                    memset(segment->buf + result, 0, segment->length - result);
+            }
+            else if (result >= 0 && static_cast<uint32_t>(result) < segment->length)
+            {
+                // Finish a short transfer synchronously; past end of file reads as zeros
+                uint8_t *buf = segment->buf + result;
+                size_t left = segment->length - result;
+                off_t offset = segment->fileOffset + result;
+                while (left > 0)
+                {
+                    ssize_t n = segment->write ? pwrite(segment->fd, buf, left, offset)
+                                               : pread(segment->fd, buf, left, offset);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n < 0 || (n == 0 && segment->write))
+                    {
+                        segment->request->failed = true;
+                        break;
+                    }
+                    if (n == 0)
+                    {
+                        memset(buf, 0, left);
+                        break;
+                    }
+                    buf += n;
+                    offset += n;
+                    left -= n;
+                }
+            }
+            else if (result < 0)
+            {
+                segment->request->failed = true;
+            }
+
+            if (segment->target)
+            {
+                if (result >= 0)
+                    memcpy(segment->target, segment->buf + segment->skip, segment->copyLength);
+                pool->Release(segment->buf);
+            }
+
+            if (--segment->request->remaining == 0)
+                finished.push_back(segment->request);
+            delete segment;
+            reaped++;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+        bool done;
+        {
+            std::lock_guard<std::mutex> lock(ringLock);
+            inFlight -= reaped;
+            done = stopping && inFlight == 0;
+        }
+        ringSpace.notify_all();
+
+        for (Pending *pending : finished)
+            Complete(pending);
+        finished.clear();
+
+        if (done)
+            break;
+    }
+}
+
+void VDIAsyncIO::WorkerLoop()
+{
+    while (true)
+    {
+        VDIAsyncRequest request;
+        {
+            std::unique_lock<std::mutex> lock(queueLock);
+            queueReady.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+            request = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        ssize_t result = request.write ? vdi->WriteAt(request.offset, request.buf, request.count)
+                                       : vdi->ReadAt(request.offset, request.buf, request.count);
+        if (request.callback)
+            request.callback(result);
+
+        std::lock_guard<std::mutex> lock(outstandingLock);
+        if (--outstanding == 0)
+            outstandingDone.notify_all();
+    }
+}
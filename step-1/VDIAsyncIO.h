@@ -0,0 +1,112 @@
+#ifndef OS_VDIASYNCIO_H
+#define OS_VDIASYNCIO_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "VDIFile.h"
+
+// Called once per request with the bytes transferred, or -1 on failure
+typedef std::function<void(ssize_t result)> VDIAsyncCallback;
+
+struct VDIAsyncRequest
+{
+    bool write;
+    uint64_t offset;            // Logical offset in the VDI disk
+    void *buf;
+    size_t count;
+    VDIAsyncCallback callback;
+};
+
+// Asynchronous block engine over a VDIFile. Requests are split into physical
+// segments with VDIFile::MapRange and submitted through io_uring; when the
+// kernel does not offer io_uring, a pool of threads runs them with ReadAt/WriteAt.
+// Callbacks run on the engine's completion thread and must not block.
+// On a VDIFile opened with VDI_OPEN_DIRECT, unaligned reads are bounced through
+// the image's buffer pool and unaligned writes run synchronously in Submit.
+class VDIAsyncIO
+{
+private:
+    struct Pending
+    {
+        std::atomic<int> remaining;
+        std::atomic<bool> failed;
+        ssize_t total;
+        VDIAsyncCallback callback;
+    };
+
+    struct Segment
+    {
+        Pending *request;
+        uint8_t *buf;
+        uint32_t length;
+        bool write;
+        uint64_t fileOffset;
+        int fd;                 // File of the chain layer holding the segment
+        uint8_t *target;        // Unaligned direct reads: buf is a bounce buffer copied
+        uint32_t skip;          // from offset skip into target for copyLength bytes
+        uint32_t copyLength;
+    };
+
+    VDIFile *vdi;
+    bool useRing;
+    bool stopping;
+
+    // io_uring state
+    int ringFd;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    void *sqeArea;
+    size_t sqeAreaSize;
+    uint32_t *sqHead, *sqTail, *sqMask, *sqArray;
+    uint32_t *cqHead, *cqTail, *cqMask;
+    void *cqes;
+    uint32_t sqEntries;
+    uint32_t inFlight;
+    std::mutex ringLock;
+    std::condition_variable ringSpace;
+    std::thread reaper;
+
+    // Thread-pool fallback state
+    std::vector<std::thread> workers;
+    std::deque<VDIAsyncRequest> queue;
+    std::mutex queueLock;
+    std::condition_variable queueReady;
+
+    // Requests submitted but not yet completed, for Wait
+    uint64_t outstanding;
+    std::mutex outstandingLock;
+    std::condition_variable outstandingDone;
+
+    bool SetupRing(unsigned queueDepth);
+    void TeardownRing();
+    bool QueueSegment(Segment *segment);
+    void ReapLoop();
+    void WorkerLoop();
+    void Complete(Pending *request);
+
+public:
+    bool Start(VDIFile *vdi, unsigned queueDepth = 64, unsigned threads = 4);
+    void Stop();
+    bool UsingIoUring() const { return useRing; }
+
+    // Submits all requests with at most one io_uring_enter; false if not started
+    bool Submit(VDIAsyncRequest *requests, int count);
+    bool SubmitRead(uint64_t offset, void *buf, size_t count, VDIAsyncCallback callback);
+    bool SubmitWrite(uint64_t offset, const void *buf, size_t count, VDIAsyncCallback callback);
+    std::future<ssize_t> ReadAsync(uint64_t offset, void *buf, size_t count);
+    std::future<ssize_t> WriteAsync(uint64_t offset, const void *buf, size_t count);
+
+    // Blocks until every submitted request has completed
+    void Wait();
+};
+
+#endif
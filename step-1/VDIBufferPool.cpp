@@ -0,0 +1,56 @@
+#include <cstdlib>
+#include <iostream>
+#include "VDIBufferPool.h"
+
+void VDIBufferPool::Init(size_t bufferSize, size_t alignment, unsigned maxFree)
+{
+    this->bufferSize = bufferSize;
+    this->alignment = alignment;
+    this->maxFree = maxFree;
+    freeBuffers.clear();
+}
+
+void VDIBufferPool::Destroy()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (void *buf : freeBuffers)
+        free(buf);
+    freeBuffers.clear();
+}
+
+void *VDIBufferPool::Acquire()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!freeBuffers.empty())
+        {
+            void *buf = freeBuffers.back();
+            freeBuffers.pop_back();
+            return buf;
+        }
+    }
+
+    void *buf = nullptr;
+    if (posix_memalign(&buf, alignment, bufferSize) != 0)
+    {
+        std::cerr << "Could not allocate an aligned buffer of " << bufferSize << " bytes" << "\n";
+        return nullptr;
+    }
+    return buf;
+}
+
+void VDIBufferPool::Release(void *buf)
+{
+    if (!buf)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (freeBuffers.size() < maxFree)
+        {
+            freeBuffers.push_back(buf);
+            return;
+        }
+    }
+    free(buf);
+}
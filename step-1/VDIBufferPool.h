@@ -0,0 +1,30 @@
+#ifndef OS_VDIBUFFERPOOL_H
+#define OS_VDIBUFFERPOOL_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Reusable I/O buffers of one size, aligned for O_DIRECT transfers. Released
+// buffers are kept for the next Acquire, up to maxFree of them.
+class VDIBufferPool
+{
+private:
+    size_t bufferSize;
+    size_t alignment;
+    unsigned maxFree;
+    std::vector<void*> freeBuffers;
+    std::mutex lock;
+
+public:
+    void Init(size_t bufferSize, size_t alignment, unsigned maxFree = 16);
+    void Destroy();
+
+    // nullptr when out of memory
+    void *Acquire();
+    void Release(void *buf);
+    size_t BufferSize() const { return bufferSize; }
+    size_t Alignment() const { return alignment; }
+};
+
+#endif
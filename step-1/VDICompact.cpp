@@ -0,0 +1,133 @@
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "VDICompact.h"
+#include "ZeroDetect.h"
+
+bool CompactVDI(char *source, char *destination, unsigned threads, unsigned window, VDICompactStats *stats)
+{
+    VDIFile src, dst;
+    if (!src.Open(source))
+        return false;
+
+    if (!dst.Create(destination, src.header->diskSize, src.header->blockSize, src.header))
+    {
+        src.Close();
+        return false;
+    }
+
+    if (threads == 0)
+        threads = 1;
+    if (window < threads)
+        window = threads;
+
+    uint32_t blockSize = src.header->blockSize;
+    uint32_t numBlocks = src.header->blocksInHDD;
+    uint64_t diskSize = src.header->diskSize;
+
+    // Slot b % window holds logical block b between its read and its write
+    std::vector<uint8_t> buffers(static_cast<size_t>(window) * blockSize);
+    std::vector<char> ready(window, 0);
+    std::vector<char> zero(window, 0);
+    uint32_t nextToRead = 0;
+    uint32_t nextToWrite = 0;
+    bool failed = false;
+    std::mutex lock;
+    std::condition_variable changed;
+
+    VDICompactStats counts = {0, 0, 0};
+
+    auto reader = [&]()
+    {
+        while (true)
+        {
+            uint32_t block;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                if (failed || nextToRead >= numBlocks)
+                    return;
+                block = nextToRead++;
+                changed.wait(guard, [&]() { return failed || block < nextToWrite + window; });
+                if (failed)
+                    return;
+            }
+
+            uint32_t slot = block % window;
+            uint8_t *buf = &buffers[static_cast<size_t>(slot) * blockSize];
+            uint64_t offset = static_cast<uint64_t>(block) * blockSize;
+            size_t length = offset + blockSize > diskSize ? diskSize - offset : blockSize;
+
+            std::vector<VDISegment> segments;
+            src.MapRange(offset, length, segments);
+            bool unallocated = segments[0].fileOffset == VDI_HOLE;
+            bool isZero = true;
+            bool ok = true;
+            if (!unallocated)
+            {
+                ok = src.ReadAt(offset, buf, length) == static_cast<ssize_t>(length);
+                isZero = ok && IsZeroBuffer(buf, length);
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (!ok)
+                failed = true;
+            zero[slot] = isZero;
+            ready[slot] = 1;
+            if (unallocated)
+                counts.blocksSkipped++;
+            else if (isZero)
+                counts.blocksDropped++;
+            changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> readers;
+    for (unsigned i = 0; i < threads; i++)
+        readers.emplace_back(reader);
+
+    // Writing strictly in logical order makes dst allocate physical blocks in that order
+    for (uint32_t block = 0; block < numBlocks; block++)
+    {
+        uint32_t slot = block % window;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&]() { return failed || ready[slot]; });
+            if (failed)
+                break;
+        }
+
+        if (!zero[slot])
+        {
+            uint64_t offset = static_cast<uint64_t>(block) * blockSize;
+            size_t length = offset + blockSize > diskSize ? diskSize - offset : blockSize;
+            if (dst.WriteAt(offset, &buffers[static_cast<size_t>(slot) * blockSize], length) != static_cast<ssize_t>(length))
+            {
+                std::cerr << "Failed to write block " << block << " to " << destination << "\n";
+                std::lock_guard<std::mutex> guard(lock);
+                failed = true;
+                changed.notify_all();
+                break;
+            }
+            counts.blocksCopied++;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        ready[slot] = 0;
+        nextToWrite = block + 1;
+        changed.notify_all();
+    }
+
+    for (std::thread &thread : readers)
+        thread.join();
+
+    bool flushed = dst.Flush();
+    dst.Close();
+    src.Close();
+
+    if (stats)
+        *stats = counts;
+    return !failed && flushed;
+}
@@ -0,0 +1,21 @@
+#ifndef OS_VDICOMPACT_H
+#define OS_VDICOMPACT_H
+
+#include <cstdint>
+#include "VDIFile.h"
+
+struct VDICompactStats
+{
+    uint32_t blocksCopied;      // Allocated in the output, in logical order
+    uint32_t blocksDropped;     // Allocated in the source but entirely zero
+    uint32_t blocksSkipped;     // Unallocated in the source
+};
+
+// Rewrites source into a new dynamic image at destination. Physical blocks are
+// laid out in ascending logical order, and blocks that are all zero are left
+// unallocated. Up to `threads` readers fill a window of `window` block buffers
+// ahead of a single in-order writer, so memory stays at window * blockSize.
+bool CompactVDI(char *source, char *destination, unsigned threads = 4, unsigned window = 16,
+                VDICompactStats *stats = nullptr);
+
+#endif
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include "VDICompact.h"
+
+bool CompareImages(char *first, char *second)
+{
+    VDIFile a, b;
+    if (!a.Open(first) || !b.Open(second))
+        return false;
+
+    bool same = a.header->diskSize == b.header->diskSize;
+    uint32_t chunk = a.header->blockSize;
+    std::vector<uint8_t> bufA(chunk), bufB(chunk);
+
+    for (uint64_t offset = 0; same && offset < a.header->diskSize; offset += chunk)
+    {
+        ssize_t readA = a.ReadAt(offset, bufA.data(), chunk);
+        ssize_t readB = b.ReadAt(offset, bufB.data(), chunk);
+        same = readA == readB && readA > 0 && memcmp(bufA.data(), bufB.data(), readA) == 0;
+    }
+
+    a.Close();
+    b.Close();
+    return same;
+}
+
+bool PhysicalBlocksInOrder(char *fn)
+{
+    VDIFile vdi;
+    if (!vdi.Open(fn))
+        return false;
+
+    bool inOrder = true;
+    uint32_t expected = 0;
+    for (uint32_t i = 0; i < vdi.header->blocksInHDD; i++)
+    {
+        uint32_t physicalBlock = vdi.translationMap[i];
+        if (physicalBlock == 0xFFFFFFFF || physicalBlock == 0xFFFFFFFE)
+            continue;
+        if (physicalBlock != expected++)
+            inOrder = false;
+    }
+
+    vdi.Close();
+    return inOrder;
+}
+
+int main()
+{
+    char source[] = "c:/dev/cpp/OS-project/vdi-files/good-dynamic-1k.vdi";
+    char destination[] = "c:/dev/cpp/OS-project/vdi-files/good-dynamic-1k-compact.vdi";
+
+    VDICompactStats stats;
+    if (!CompactVDI(source, destination, 4, 16, &stats))
+    {
+        std::cerr << "Compact: Failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Compact: Copied " << stats.blocksCopied << ", dropped " << stats.blocksDropped
+              << " zero blocks, skipped " << stats.blocksSkipped << " unallocated" << std::endl;
+    std::cout << "Contents match: " << (CompareImages(source, destination) ? "yes" : "no") << std::endl;
+    std::cout << "Physical order: " << (PhysicalBlocksInOrder(destination) ? "ascending" : "scattered") << std::endl;
+    return 0;
+}
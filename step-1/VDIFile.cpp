@@ -1,9 +1,17 @@
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include "VDIFile.h"
+#include "ZeroDetect.h"
 
-bool VDIFile::Open(char *fn)
+bool VDIFile::Open(char *fn, int flags)
 {
     fileDescriptor = open(fn, O_RDWR);
 
@@ -14,6 +22,24 @@ bool VDIFile::Open(char *fn)
     }
 
     cursor = 0;
+    references = 1;
+    headerDirty = false;
+    dirtyMapChunks.clear();
+    pendingAllocations = 0;
+    flushThreshold = 0;
+    elideZeros = (flags & VDI_OPEN_ELIDE_ZEROS) != 0;
+    parents.clear();
+    extents.clear();
+    lazyMap = (flags & VDI_OPEN_LAZY_MAP) != 0;
+    indexedChunks.clear();
+    translationMap = nullptr;
+    directDescriptor = -1;
+    bufferPool = nullptr;
+    mapRegion = nullptr;
+    dataRegion = nullptr;
+    mappedData = nullptr;
+    mappedDataSize = 0;
+    zeroBlock = nullptr;
     header = new VDIHeader;
 
     ssize_t bytesRead = read(fileDescriptor, header, sizeof(VDIHeader));
@@ -26,24 +52,457 @@ bool VDIFile::Open(char *fn)
         return false;
     }
 
-    if (header->imageType == 1)
+    struct stat st;
+    if (fstat(fileDescriptor, &st) < 0)
     {
-        uint32_t numBlocks = header->blocksInHDD;
-        translationMap = new uint32_t[numBlocks];
+        std::cerr << "Could not stat file " << fn << "\n";
+        Close();
+        return false;
+    }
+    fileSize = st.st_size;
+
+    if (flags & VDI_OPEN_DIRECT)
+    {
+        directDescriptor = open(fn, O_RDWR | O_DIRECT);
+        if (directDescriptor < 0)
+        {
+            std::cerr << "Could not open file " << fn << " for direct I/O" << "\n";
+            Close();
+            return false;
+        }
+        bufferPool = new VDIBufferPool;
+        bufferPool->Init(VDI_DIRECT_BUFFER_SIZE, VDI_DIRECT_ALIGNMENT);
+    }
+
+    if (flags & VDI_OPEN_MMAP)
+    {
+        if (!MapImage(fileSize))
+        {
+            std::cerr << "Could not map file " << fn << "\n";
+            Close();
+            return false;
+        }
+    }
+    else if (header->imageType == 1 || header->imageType == 4)
+    {
+        bool loaded;
+        if (lazyMap)
+            loaded = MapTranslationMap();
+        else
+        {
+            uint32_t numBlocks = header->blocksInHDD;
+            translationMap = new uint32_t[numBlocks];
+            loaded = PRead(translationMap, numBlocks * sizeof(uint32_t), header->offsetBlocks);
+        }
+
+        if (!loaded)
+        {
+            std::cerr << "Could not read block map of " << fn << "\n";
+            Close();
+            return false;
+        }
+    }
+
+    BuildExtentIndex();
+    SelectReadPath();
+    return true;
+}
+
+bool VDIFile::Create(char *fn, uint64_t diskSize, uint32_t blockSize, const VDIHeader *model)
+{
+    if (blockSize == 0 || blockSize % 512 != 0)
+    {
+        std::cerr << "Invalid block size " << blockSize << "\n";
+        return false;
+    }
+
+    uint64_t numBlocks = (diskSize + blockSize - 1) / blockSize;
+    if (numBlocks >= 0xFFFFFFFE)
+    {
+        std::cerr << "Disk too large for block size " << blockSize << "\n";
+        return false;
+    }
+
+    VDIHeader newHeader;
+    memset(&newHeader, 0, sizeof(VDIHeader));
+    strncpy(newHeader.signature, "<<< Oracle VM VirtualBox Disk Image >>>\n", sizeof(newHeader.signature));
+    newHeader.imageSignature = 0xBEDA107F;
+    newHeader.version1 = 1;
+    newHeader.version2 = 1;
+    newHeader.headerSize = 400;
+    newHeader.imageType = 1;
+    newHeader.offsetBlocks = 512;
+    newHeader.offsetData = (512 + numBlocks * sizeof(uint32_t) + 4095) & ~4095ull;
+    newHeader.sectorSize = 512;
+    newHeader.diskSize = diskSize;
+    newHeader.blockSize = blockSize;
+    newHeader.blocksInHDD = numBlocks;
+    newHeader.blocksAllocated = 0;
+
+    // Random version 4 UUID for the new image
+    int randomFd = open("/dev/urandom", O_RDONLY);
+    if (randomFd >= 0)
+    {
+        read(randomFd, newHeader.uuidImage, sizeof(newHeader.uuidImage));
+        close(randomFd);
+    }
+    newHeader.uuidImage[6] = (newHeader.uuidImage[6] & 0x0F) | 0x40;
+    newHeader.uuidImage[8] = (newHeader.uuidImage[8] & 0x3F) | 0x80;
+    memcpy(newHeader.uuidLastSnap, newHeader.uuidImage, sizeof(newHeader.uuidImage));
+
+    // A rewritten copy keeps the identity and geometry of the image it replaces
+    if (model)
+    {
+        memcpy(newHeader.signature, model->signature, sizeof(newHeader.signature));
+        memcpy(newHeader.imageDescription, model->imageDescription, sizeof(newHeader.imageDescription));
+        newHeader.flags = model->flags;
+        if (model->imageType == 4)
+            newHeader.imageType = 4;
+        newHeader.cylinders = model->cylinders;
+        newHeader.heads = model->heads;
+        newHeader.sectors = model->sectors;
+        newHeader.sectorSize = model->sectorSize;
+        memcpy(newHeader.uuidImage, model->uuidImage, sizeof(newHeader.uuidImage));
+        memcpy(newHeader.uuidLastSnap, model->uuidLastSnap, sizeof(newHeader.uuidLastSnap));
+        memcpy(newHeader.uuidLink, model->uuidLink, sizeof(newHeader.uuidLink));
+        memcpy(newHeader.uuidParent, model->uuidParent, sizeof(newHeader.uuidParent));
+    }
 
-        lseek(fileDescriptor, header->offsetBlocks, SEEK_SET);
-        read(fileDescriptor, translationMap, numBlocks * sizeof(uint32_t));
+    fileDescriptor = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fileDescriptor < 0)
+    {
+        std::cerr << "Could not create file " << fn << "\n";
+        return false;
     }
+
+    uint32_t *emptyMap = new uint32_t[numBlocks];
+    memset(emptyMap, 0xFF, numBlocks * sizeof(uint32_t));
+    bool written = PWrite(&newHeader, sizeof(VDIHeader), 0) &&
+                   PWrite(emptyMap, numBlocks * sizeof(uint32_t), newHeader.offsetBlocks) &&
+                   ftruncate(fileDescriptor, newHeader.offsetData) == 0;
+    delete[] emptyMap;
+    close(fileDescriptor);
+    fileDescriptor = -1;
+
+    if (!written)
+    {
+        std::cerr << "Could not write file " << fn << "\n";
+        return false;
+    }
+
+    return Open(fn);
+}
+
+bool VDIFile::CreateDiff(char *fn, const VDIHeader *parent)
+{
+    if (!Create(fn, parent->diskSize, parent->blockSize))
+        return false;
+
+    // uuidLink names the parent image and uuidParent the parent's state when the
+    // snapshot was taken. Both reach the disk with the next Flush.
+    header->imageType = 4;
+    memcpy(header->uuidLink, parent->uuidImage, sizeof(header->uuidLink));
+    memcpy(header->uuidParent, parent->uuidLastSnap, sizeof(header->uuidParent));
+    headerDirty = true;
+    return Flush();
+}
+
+bool VDIFile::OpenChain(char **fileNames, int count, int flags)
+{
+    if (count < 1 || !Open(fileNames[count - 1], flags))
+        return false;
+    if (count == 1)
+        return true;
+
+    if (!translationMap)
+    {
+        std::cerr << "Image " << fileNames[count - 1] << " cannot have a parent" << "\n";
+        Close();
+        return false;
+    }
+
+    VDIHeader *child = header;
+    for (int i = count - 2; i >= 0; i--)
+    {
+        VDIFile *parent = new VDIFile;
+        if (!parent->Open(fileNames[i], flags & (VDI_OPEN_LAZY_MAP | VDI_OPEN_DIRECT)))
+        {
+            delete parent;
+            Close();
+            return false;
+        }
+        parents.push_back(parent);
+
+        if (memcmp(child->uuidLink, parent->header->uuidImage, sizeof(child->uuidLink)) != 0 ||
+            parent->header->blockSize != header->blockSize || parent->header->blocksInHDD != header->blocksInHDD)
+        {
+            std::cerr << "Image " << fileNames[i + 1] << " is not a child of " << fileNames[i] << "\n";
+            Close();
+            return false;
+        }
+        if (memcmp(child->uuidParent, parent->header->uuidLastSnap, sizeof(child->uuidParent)) != 0)
+            std::cerr << "Warning: " << fileNames[i] << " was modified after " << fileNames[i + 1] << " was created" << "\n";
+
+        child = parent->header;
+    }
+
+    // The index and read path Open picked only knew the top image
+    BuildExtentIndex();
+    SelectReadPath();
+    return true;
+}
+
+// Whether next, starting right after prev, can be folded into it
+static bool ContinuesExtent(const VDIExtent &prev, const VDIExtent &next)
+{
+    if (prev.physicalBlock == 0xFFFFFFFF || next.physicalBlock == 0xFFFFFFFF)
+        return prev.physicalBlock == next.physicalBlock;
+    return prev.layer == next.layer && prev.physicalBlock + prev.length == next.physicalBlock;
+}
+
+VDIExtent VDIFile::MapEntry(uint32_t logicalBlock)
+{
+    // Unallocated (0xFFFFFFFF) falls through to the parent; a zero block
+    // (0xFFFFFFFE) ends the search and reads as zeros.
+    VDIExtent extent = {1, logicalBlock, 0};
+    if (translationMap)
+        extent.physicalBlock = translationMap[logicalBlock];
+    for (uint32_t layer = 1; extent.physicalBlock == 0xFFFFFFFF && layer <= parents.size(); layer++)
+    {
+        uint32_t *parentMap = parents[layer - 1]->translationMap;
+        uint32_t physicalBlock = parentMap ? parentMap[logicalBlock] : logicalBlock;
+        if (physicalBlock != 0xFFFFFFFF)
+            extent = {1, physicalBlock, layer};
+    }
+    if (extent.physicalBlock == 0xFFFFFFFE)
+        extent = {1, 0xFFFFFFFF, 0};
+    return extent;
+}
+
+void VDIFile::BuildExtentIndex()
+{
+    extents.clear();
+
+    uint32_t numBlocks = header->blocksInHDD;
+    if (lazyMap)
+        indexedChunks.assign((numBlocks + VDI_INDEX_CHUNK_ENTRIES - 1) / VDI_INDEX_CHUNK_ENTRIES, 0);
     else
+        IndexBlocks(0, numBlocks);
+}
+
+// Caller holds extentLock exclusively; [first, end) must not be indexed yet
+void VDIFile::IndexBlocks(uint32_t first, uint32_t end)
+{
+    if (first >= end)
+        return;
+
+    auto hint = extents.lower_bound(first);
+    auto last = extents.end();
+    for (uint32_t logicalBlock = first; logicalBlock < end; logicalBlock++)
     {
-        translationMap = nullptr;
+        VDIExtent extent = MapEntry(logicalBlock);
+        if (last != extents.end() && ContinuesExtent(last->second, extent))
+            last->second.length++;
+        else
+            last = extents.emplace_hint(hint, logicalBlock, extent);
+    }
+
+    // Join the new run to already indexed neighbours on either side
+    MergeExtent(last);
+    MergeExtent(std::prev(extents.upper_bound(first)));
+}
+
+// Caller holds extentLock exclusively
+void VDIFile::IndexChunks(uint32_t firstBlock, uint32_t lastBlock)
+{
+    uint32_t numBlocks = header->blocksInHDD;
+    for (uint32_t chunk = firstBlock / VDI_INDEX_CHUNK_ENTRIES; chunk <= lastBlock / VDI_INDEX_CHUNK_ENTRIES; chunk++)
+    {
+        if (indexedChunks[chunk])
+            continue;
+        uint32_t start = chunk * VDI_INDEX_CHUNK_ENTRIES;
+        uint32_t end = numBlocks - start > VDI_INDEX_CHUNK_ENTRIES ? start + VDI_INDEX_CHUNK_ENTRIES : numBlocks;
+        IndexBlocks(start, end);
+        indexedChunks[chunk] = 1;
+    }
+}
+
+void VDIFile::EnsureIndexed(uint32_t firstBlock, uint32_t lastBlock)
+{
+    if (!lazyMap)
+        return;
+
+    {
+        std::shared_lock<std::shared_mutex> lock(extentLock);
+        bool missing = false;
+        for (uint32_t chunk = firstBlock / VDI_INDEX_CHUNK_ENTRIES; !missing && chunk <= lastBlock / VDI_INDEX_CHUNK_ENTRIES; chunk++)
+            missing = !indexedChunks[chunk];
+        if (!missing)
+            return;
     }
 
+    std::unique_lock<std::shared_mutex> lock(extentLock);
+    IndexChunks(firstBlock, lastBlock);
+}
+
+// Folds it into its neighbours where they continue each other; returns the merged extent
+std::map<uint32_t, VDIExtent>::iterator VDIFile::MergeExtent(std::map<uint32_t, VDIExtent>::iterator it)
+{
+    if (it != extents.begin() && ContinuesExtent(std::prev(it)->second, it->second) &&
+        std::prev(it)->first + std::prev(it)->second.length == it->first)
+    {
+        auto prev = std::prev(it);
+        prev->second.length += it->second.length;
+        extents.erase(it);
+        it = prev;
+    }
+    auto next = std::next(it);
+    if (next != extents.end() && ContinuesExtent(it->second, next->second) && it->first + it->second.length == next->first)
+    {
+        it->second.length += next->second.length;
+        extents.erase(next);
+    }
+    return it;
+}
+
+void VDIFile::SetExtent(uint32_t logicalBlock, uint32_t physicalBlock, uint32_t layer)
+{
+    std::unique_lock<std::shared_mutex> lock(extentLock);
+    if (lazyMap)
+        IndexChunks(logicalBlock, logicalBlock);
+
+    // Cut the block out of the extent holding it, leaving up to two neighbours
+    auto it = std::prev(extents.upper_bound(logicalBlock));
+    uint32_t start = it->first;
+    VDIExtent old = it->second;
+    extents.erase(it);
+
+    if (logicalBlock > start)
+        extents[start] = {logicalBlock - start, old.physicalBlock, old.layer};
+    uint32_t skip = logicalBlock + 1 - start;
+    if (skip < old.length)
+    {
+        uint32_t after = old.physicalBlock == 0xFFFFFFFF ? 0xFFFFFFFF : old.physicalBlock + skip;
+        extents[logicalBlock + 1] = {old.length - skip, after, old.layer};
+    }
+
+    // Merge back with whichever neighbours the new block continues
+    MergeExtent(extents.insert({logicalBlock, {1, physicalBlock, layer}}).first);
+}
+
+void VDIFile::ResolveBlock(uint32_t logicalBlock, uint32_t &layer, uint32_t &physicalBlock)
+{
+    EnsureIndexed(logicalBlock, logicalBlock);
+    std::shared_lock<std::shared_mutex> lock(extentLock);
+
+    auto it = std::prev(extents.upper_bound(logicalBlock));
+    layer = it->second.layer;
+    physicalBlock = it->second.physicalBlock;
+    if (physicalBlock != 0xFFFFFFFF)
+        physicalBlock += logicalBlock - it->first;
+}
+
+bool VDIFile::CopyFromParent(uint32_t logicalBlock, uint32_t physicalBlock)
+{
+    uint32_t layer, sourceBlock;
+    ResolveBlock(logicalBlock, layer, sourceBlock);
+    if (layer == 0 || sourceBlock == 0xFFFFFFFF)
+        return true;
+
+    VDIFile *parent = parents[layer - 1];
+    uint32_t blockSize = header->blockSize;
+    uint8_t *buf = new uint8_t[blockSize];
+    struct iovec iov = {buf, blockSize};
+    bool copied = parent->DataReadV(&iov, 1, parent->header->offsetData + static_cast<uint64_t>(sourceBlock) * blockSize) &&
+                  DataWriteV(&iov, 1, header->offsetData + static_cast<uint64_t>(physicalBlock) * blockSize);
+    delete[] buf;
+    return copied;
+}
+
+bool VDIFile::MapTranslationMap()
+{
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+
+    // The map is mapped private so allocations can update it in place; Flush
+    // still persists every entry they change with pwrite. Pages are only read
+    // in, and only take memory, once an entry on them is used.
+    uint64_t mapStart = header->offsetBlocks & ~(pageSize - 1);
+    mapRegionSize = header->offsetBlocks - mapStart + static_cast<uint64_t>(header->blocksInHDD) * sizeof(uint32_t);
+
+    void *region = mmap(nullptr, mapRegionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileDescriptor, mapStart);
+    if (region == MAP_FAILED)
+        return false;
+
+    mapRegion = reinterpret_cast<uint8_t*>(region);
+    translationMap = reinterpret_cast<uint32_t*>(mapRegion + (header->offsetBlocks - mapStart));
+    return true;
+}
+
+bool VDIFile::MapImage(uint64_t fileSize)
+{
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+
+    if ((header->imageType == 1 || header->imageType == 4) && !MapTranslationMap())
+        return false;
+
+    // Blocks allocated after Open lie past the mapping and fall back to pread.
+    // Direct I/O leaves the data area unmapped, so reads skip the page cache.
+    if (fileSize > header->offsetData && directDescriptor < 0)
+    {
+        uint64_t dataStart = header->offsetData & ~(pageSize - 1);
+        dataRegionSize = fileSize - dataStart;
+
+        void *region = mmap(nullptr, dataRegionSize, PROT_READ, MAP_SHARED, fileDescriptor, dataStart);
+        if (region == MAP_FAILED)
+            return false;
+
+        dataRegion = reinterpret_cast<uint8_t*>(region);
+        mappedData = dataRegion + (header->offsetData - dataStart);
+        mappedDataSize = fileSize - header->offsetData;
+    }
+
+    void *zeros = mmap(nullptr, header->blockSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (zeros == MAP_FAILED)
+        return false;
+    zeroBlock = reinterpret_cast<uint8_t*>(zeros);
+
     return true;
 }
 
+void VDIFile::UnmapImage()
+{
+    if (mapRegion)
+    {
+        munmap(mapRegion, mapRegionSize);
+        mapRegion = nullptr;
+        translationMap = nullptr;
+    }
+    if (dataRegion)
+    {
+        munmap(dataRegion, dataRegionSize);
+        dataRegion = nullptr;
+        mappedData = nullptr;
+        mappedDataSize = 0;
+    }
+    if (zeroBlock)
+    {
+        munmap(zeroBlock, header->blockSize);
+        zeroBlock = nullptr;
+    }
+}
+
 void VDIFile::Close()
 {
+    if (header && !Flush())
+        std::cerr << "Could not flush metadata on close" << "\n";
+    for (VDIFile *parent : parents)
+    {
+        parent->Close();
+        delete parent;
+    }
+    parents.clear();
+    extents.clear();
+    UnmapImage();
     delete header;
     header = nullptr;
     if (translationMap)
@@ -56,121 +515,708 @@ void VDIFile::Close()
         close(fileDescriptor);
         fileDescriptor = -1;
     }
+    if (directDescriptor >= 0)
+    {
+        close(directDescriptor);
+        directDescriptor = -1;
+    }
+    if (bufferPool)
+    {
+        bufferPool->Destroy();
+        delete bufferPool;
+        bufferPool = nullptr;
+    }
 }
 
-ssize_t VDIFile::Read(void *buf, size_t count)
+void VDIFile::Release()
+{
+    if (--references == 0)
+    {
+        Close();
+        delete this;
+    }
+}
+
+// Drops the first count bytes from an iovec array after a short transfer
+static void AdvanceIovec(struct iovec *&iov, int &iovcnt, size_t count)
 {
-    size_t totalRead = 0;
-    uint8_t *buffer = reinterpret_cast<uint8_t*>(buf);
+    while (iovcnt > 0 && count >= iov->iov_len)
+    {
+        count -= iov->iov_len;
+        iov++;
+        iovcnt--;
+    }
+    if (iovcnt > 0)
+    {
+        iov->iov_base = reinterpret_cast<uint8_t*>(iov->iov_base) + count;
+        iov->iov_len -= count;
+    }
+}
 
+// Appends the next count bytes of a caller's iovec array to pieces, starting at (index, offset)
+static void SliceIovec(const struct iovec *iov, int &index, size_t &offset, uint64_t count, std::vector<struct iovec> &pieces)
+{
+    pieces.clear();
     while (count > 0)
     {
-        uint32_t blockSize = header->blockSize;
-        uint32_t logicalBlock = cursor / blockSize;
-        uint32_t offsetInBlock = cursor % blockSize;
+        size_t available = iov[index].iov_len - offset;
+        size_t take = available < count ? available : count;
+        if (take > 0)
+            pieces.push_back({reinterpret_cast<uint8_t*>(iov[index].iov_base) + offset, take});
 
-        size_t bytesInBlock = blockSize - offsetInBlock;
-        if (bytesInBlock > count)
-            bytesInBlock = count;
+        count -= take;
+        offset += take;
+        if (offset == iov[index].iov_len)
+        {
+            index++;
+            offset = 0;
+        }
+    }
+}
 
-        uint32_t physicalBlock = 0;
+bool VDIFile::PReadV(struct iovec *iov, int iovcnt, off_t offset)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t bytesRead = preadv(fileDescriptor, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX, offset);
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Could not read from file descriptor " << fileDescriptor << "\n";
+            return false;
+        }
+        if (bytesRead == 0)
+        {
+            // Past the end of the image file, reads as zeros
+            for (int i = 0; i < iovcnt; i++)
+                memset(iov[i].iov_base, 0, iov[i].iov_len);
+            return true;
+        }
 
-        if (translationMap)
-            physicalBlock = translationMap[logicalBlock];
+        offset += bytesRead;
+        AdvanceIovec(iov, iovcnt, bytesRead);
+    }
+    return true;
+}
 
-        if (physicalBlock == 0xFFFFFFFF)
+bool VDIFile::PWriteV(struct iovec *iov, int iovcnt, off_t offset)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t bytesWritten = pwritev(fileDescriptor, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX, offset);
+        if (bytesWritten < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Could not write to file descriptor " << fileDescriptor << "\n";
+            return false;
+        }
+
+        offset += bytesWritten;
+        AdvanceIovec(iov, iovcnt, bytesWritten);
+    }
+    return true;
+}
+
+static bool IsDirectAligned(const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    if (offset % VDI_DIRECT_ALIGNMENT != 0)
+        return false;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (reinterpret_cast<uintptr_t>(iov[i].iov_base) % VDI_DIRECT_ALIGNMENT != 0 || iov[i].iov_len % VDI_DIRECT_ALIGNMENT != 0)
+            return false;
+    }
+    return true;
+}
+
+bool VDIFile::DataReadV(struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    if (directDescriptor < 0)
+        return PReadV(iov, iovcnt, offset);
+    if (!IsDirectAligned(iov, iovcnt, offset))
+        return BounceRead(iov, iovcnt, offset);
+
+    // One buffer at a time, so a short read at the end of the file can be zero-filled
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (!ReadAligned(reinterpret_cast<uint8_t*>(iov[i].iov_base), iov[i].iov_len, offset))
+            return false;
+        offset += iov[i].iov_len;
+    }
+    return true;
+}
+
+bool VDIFile::DataWriteV(struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    if (directDescriptor < 0)
+        return PWriteV(iov, iovcnt, offset);
+    if (!IsDirectAligned(iov, iovcnt, offset))
+        return BounceWrite(iov, iovcnt, offset);
+
+    while (iovcnt > 0)
+    {
+        ssize_t bytesWritten = pwritev(directDescriptor, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX, offset);
+        if (bytesWritten < 0)
         {
-            memset(buffer, 0, bytesInBlock);
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Could not write to file descriptor " << directDescriptor << "\n";
+            return false;
         }
-        else if (physicalBlock == 0xFFFFFFFE)
+
+        offset += bytesWritten;
+        AdvanceIovec(iov, iovcnt, bytesWritten);
+    }
+    return true;
+}
+
+// buf, count and offset are all multiples of VDI_DIRECT_ALIGNMENT
+bool VDIFile::ReadAligned(uint8_t *buf, size_t count, uint64_t offset)
+{
+    while (count > 0)
+    {
+        ssize_t bytesRead = pread(directDescriptor, buf, count, offset);
+        if (bytesRead < 0)
         {
-            memset(buffer, 0, bytesInBlock);
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Could not read from file descriptor " << directDescriptor << "\n";
+            return false;
         }
-        else
+        if (bytesRead == 0 || bytesRead % VDI_DIRECT_ALIGNMENT != 0)
+        {
+            // Direct reads only come up short at the end of the file; the rest reads as zeros
+            memset(buf + bytesRead, 0, count - bytesRead);
+            return true;
+        }
+
+        buf += bytesRead;
+        offset += bytesRead;
+        count -= bytesRead;
+    }
+    return true;
+}
+
+bool VDIFile::BounceRead(struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    uint8_t *bounce = reinterpret_cast<uint8_t*>(bufferPool->Acquire());
+    if (!bounce)
+        return false;
+
+    uint64_t count = 0;
+    for (int i = 0; i < iovcnt; i++)
+        count += iov[i].iov_len;
+
+    std::vector<struct iovec> pieces;
+    int iovIndex = 0;
+    size_t iovOffset = 0;
+    bool ok = true;
+
+    while (ok && count > 0)
+    {
+        uint64_t start = offset & ~static_cast<uint64_t>(VDI_DIRECT_ALIGNMENT - 1);
+        size_t skip = offset - start;
+        size_t take = bufferPool->BufferSize() - skip;
+        if (take > count)
+            take = count;
+        size_t span = (skip + take + VDI_DIRECT_ALIGNMENT - 1) & ~static_cast<size_t>(VDI_DIRECT_ALIGNMENT - 1);
+
+        ok = ReadAligned(bounce, span, start);
+        SliceIovec(iov, iovIndex, iovOffset, take, pieces);
+        const uint8_t *source = bounce + skip;
+        for (const struct iovec &piece : pieces)
         {
-            off_t physicalOffset;
+            memcpy(piece.iov_base, source, piece.iov_len);
+            source += piece.iov_len;
+        }
 
-            if (translationMap)
-                physicalOffset = header->offsetData + (physicalBlock * blockSize) + offsetInBlock;
-            else
-                physicalOffset = header->offsetData + (logicalBlock * blockSize) + offsetInBlock;
+        offset += take;
+        count -= take;
+    }
 
-            lseek(fileDescriptor, physicalOffset, SEEK_SET);
-            ssize_t bytesRead = read(fileDescriptor, buffer, bytesInBlock);
-            if (bytesRead < 0)
-            {
-                std::cerr << "Could not read from file descriptor " << fileDescriptor << "\n";
-                return -1;
-            }
+    bufferPool->Release(bounce);
+    return ok;
+}
+
+bool VDIFile::BounceWrite(struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    uint8_t *bounce = reinterpret_cast<uint8_t*>(bufferPool->Acquire());
+    if (!bounce)
+        return false;
+
+    uint64_t count = 0;
+    for (int i = 0; i < iovcnt; i++)
+        count += iov[i].iov_len;
+
+    std::vector<struct iovec> pieces;
+    int iovIndex = 0;
+    size_t iovOffset = 0;
+    bool ok = true;
+
+    std::lock_guard<std::mutex> lock(directLock);
+    while (ok && count > 0)
+    {
+        uint64_t start = offset & ~static_cast<uint64_t>(VDI_DIRECT_ALIGNMENT - 1);
+        size_t skip = offset - start;
+        size_t take = bufferPool->BufferSize() - skip;
+        if (take > count)
+            take = count;
+        size_t span = (skip + take + VDI_DIRECT_ALIGNMENT - 1) & ~static_cast<size_t>(VDI_DIRECT_ALIGNMENT - 1);
+
+        // Sectors the write only partly covers keep the rest of their old bytes
+        if (skip != 0)
+            ok = ReadAligned(bounce, VDI_DIRECT_ALIGNMENT, start);
+        if (ok && (skip + take) % VDI_DIRECT_ALIGNMENT != 0 && !(skip != 0 && span == VDI_DIRECT_ALIGNMENT))
+            ok = ReadAligned(bounce + span - VDI_DIRECT_ALIGNMENT, VDI_DIRECT_ALIGNMENT, start + span - VDI_DIRECT_ALIGNMENT);
+
+        SliceIovec(iov, iovIndex, iovOffset, take, pieces);
+        uint8_t *destination = bounce + skip;
+        for (const struct iovec &piece : pieces)
+        {
+            memcpy(destination, piece.iov_base, piece.iov_len);
+            destination += piece.iov_len;
         }
 
-        cursor += bytesInBlock;
-        buffer += bytesInBlock;
-        totalRead += bytesInBlock;
-        count -= bytesInBlock;
+        struct iovec aligned = {bounce, span};
+        ok = ok && DataWriteV(&aligned, 1, start);
+
+        offset += take;
+        count -= take;
     }
-    return totalRead;
+
+    bufferPool->Release(bounce);
+    return ok;
+}
+
+bool VDIFile::PRead(void *buf, size_t count, off_t offset)
+{
+    struct iovec iov = {buf, count};
+    return PReadV(&iov, 1, offset);
+}
+
+bool VDIFile::PWrite(const void *buf, size_t count, off_t offset)
+{
+    struct iovec iov = {const_cast<void*>(buf), count};
+    return PWriteV(&iov, 1, offset);
+}
+
+ssize_t VDIFile::Read(void *buf, size_t count)
+{
+    ssize_t bytesRead = ReadAt(cursor, buf, count);
+    if (bytesRead > 0)
+        cursor += bytesRead;
+    return bytesRead;
 }
 
 ssize_t VDIFile::Write(void *buf, size_t count)
 {
-    ssize_t totalWritten = 0;
-    uint8_t* buffer = reinterpret_cast<uint8_t*>(buf);
+    ssize_t bytesWritten = WriteAt(cursor, buf, count);
+    if (bytesWritten > 0)
+        cursor += bytesWritten;
+    return bytesWritten;
+}
+
+ssize_t VDIFile::ReadAt(uint64_t offset, void *buf, size_t count)
+{
+    struct iovec iov = {buf, count};
+    return ReadV(offset, &iov, 1);
+}
+
+ssize_t VDIFile::WriteAt(uint64_t offset, const void *buf, size_t count)
+{
+    struct iovec iov = {const_cast<void*>(buf), count};
+    return WriteV(offset, &iov, 1);
+}
+
+void VDIFile::MapRange(uint64_t offset, uint64_t count, std::vector<VDISegment> &segments)
+{
+    segments.clear();
+    if (count == 0)
+        return;
 
+    uint32_t blockSize = header->blockSize;
+    EnsureIndexed(offset / blockSize, (offset + count - 1) / blockSize);
+    std::shared_lock<std::shared_mutex> lock(extentLock);
+
+    // Extents are kept maximal, so each one the range touches becomes one segment
+    auto it = std::prev(extents.upper_bound(offset / blockSize));
     while (count > 0)
     {
-        uint32_t blockSize = header->blockSize;
-        uint32_t logicalBlock = cursor / blockSize;
-        uint32_t offsetInBlock = cursor % blockSize;
+        const VDIExtent &extent = it->second;
+        uint64_t extentStart = static_cast<uint64_t>(it->first) * blockSize;
+        uint64_t length = extentStart + static_cast<uint64_t>(extent.length) * blockSize - offset;
+        if (length > count)
+            length = count;
 
-        size_t bytesInBlock = blockSize - offsetInBlock;
-        if (bytesInBlock > count)
-            bytesInBlock = count;
+        uint64_t fileOffset = VDI_HOLE;
+        if (extent.physicalBlock != 0xFFFFFFFF)
+        {
+            uint32_t offsetData = extent.layer == 0 ? header->offsetData : parents[extent.layer - 1]->header->offsetData;
+            fileOffset = offsetData + static_cast<uint64_t>(extent.physicalBlock) * blockSize + (offset - extentStart);
+        }
+        segments.push_back({fileOffset, length, extent.layer});
 
-        uint32_t physicalBlock = 0;
-        if (translationMap)
-            physicalBlock = translationMap[logicalBlock];
+        offset += length;
+        count -= length;
+        ++it;
+    }
+}
+
+// Reads count bytes at fileOffset of one layer's file, from the mapping when it covers them
+bool VDIFile::ReadRun(uint32_t layer, uint64_t fileOffset, struct iovec *iov, int iovcnt, uint64_t count)
+{
+    if (layer > 0)
+        return parents[layer - 1]->DataReadV(iov, iovcnt, fileOffset);
+
+    if (fileOffset - header->offsetData + count <= mappedDataSize)
+    {
+        const uint8_t *source = mappedData + (fileOffset - header->offsetData);
+        for (int i = 0; i < iovcnt; i++)
+        {
+            memcpy(iov[i].iov_base, source, iov[i].iov_len);
+            source += iov[i].iov_len;
+        }
+        return true;
+    }
+    return DataReadV(iov, iovcnt, fileOffset);
+}
+
+// General read path: splits the range into segments and reads each run
+ssize_t VDIFile::ReadSegments(uint64_t offset, const struct iovec *iov, int iovcnt, uint64_t count)
+{
+    std::vector<VDISegment> segments;
+    MapRange(offset, count, segments);
+
+    std::vector<struct iovec> pieces;
+    int iovIndex = 0;
+    size_t iovOffset = 0;
+
+    for (const VDISegment &segment : segments)
+    {
+        SliceIovec(iov, iovIndex, iovOffset, segment.length, pieces);
+
+        if (segment.fileOffset == VDI_HOLE)
+        {
+            for (const struct iovec &piece : pieces)
+                memset(piece.iov_base, 0, piece.iov_len);
+        }
+        else if (!ReadRun(segment.layer, segment.fileOffset, pieces.data(), pieces.size(), segment.length))
+        {
+            return -1;
+        }
+    }
+    return count;
+}
+
+// Fixed: the request is one run of the data area, read without touching the index.
+// Dynamic: a request inside one block is resolved with a single lookup; wider
+// ones take ReadSegments.
+template <bool Fixed, bool PowerOfTwoBlocks>
+ssize_t VDIFile::ReadLayout(uint64_t offset, const struct iovec *iov, int iovcnt, uint64_t count)
+{
+    uint64_t fileOffset;
+    uint32_t layer = 0;
+
+    if constexpr (Fixed)
+    {
+        fileOffset = header->offsetData + offset;
+    }
+    else
+    {
+        uint32_t blockSize = header->blockSize;
+        uint64_t logicalBlock = PowerOfTwoBlocks ? offset >> blockShift : offset / blockSize;
+        uint64_t offsetInBlock = PowerOfTwoBlocks ? offset & (blockSize - 1) : offset % blockSize;
+        if (offsetInBlock + count > blockSize)
+            return ReadSegments(offset, iov, iovcnt, count);
 
+        uint32_t physicalBlock;
+        ResolveBlock(logicalBlock, layer, physicalBlock);
         if (physicalBlock == 0xFFFFFFFF)
+            fileOffset = VDI_HOLE;
+        else
         {
-            physicalBlock = header->blocksAllocated;
-            header->blocksAllocated++;
-            translationMap[logicalBlock] = physicalBlock;
+            uint64_t blockOffset = PowerOfTwoBlocks ? static_cast<uint64_t>(physicalBlock) << blockShift
+                                                    : static_cast<uint64_t>(physicalBlock) * blockSize;
+            uint32_t offsetData = layer == 0 ? header->offsetData : parents[layer - 1]->header->offsetData;
+            fileOffset = offsetData + blockOffset + offsetInBlock;
+        }
+    }
+
+    // The caller's array is const and may run past the clamped count
+    struct iovec single;
+    std::vector<struct iovec> pieces;
+    struct iovec *run = &single;
+    int runCount = 1;
+    if (iovcnt == 1)
+        single = {iov[0].iov_base, count};
+    else
+    {
+        int iovIndex = 0;
+        size_t iovOffset = 0;
+        SliceIovec(iov, iovIndex, iovOffset, count, pieces);
+        run = pieces.data();
+        runCount = pieces.size();
+    }
+
+    if (fileOffset == VDI_HOLE)
+    {
+        for (int i = 0; i < runCount; i++)
+            memset(run[i].iov_base, 0, run[i].iov_len);
+        return count;
+    }
+    return ReadRun(layer, fileOffset, run, runCount, count) ? count : -1;
+}
+
+void VDIFile::SelectReadPath()
+{
+    uint32_t blockSize = header->blockSize;
+    bool powerOfTwo = blockSize != 0 && (blockSize & (blockSize - 1)) == 0;
+    blockShift = powerOfTwo ? __builtin_ctz(blockSize) : 0;
+
+    if (!translationMap && parents.empty())
+        readPath = &VDIFile::ReadLayout<true, false>;
+    else if (powerOfTwo)
+        readPath = &VDIFile::ReadLayout<false, true>;
+    else
+        readPath = &VDIFile::ReadLayout<false, false>;
+}
+
+ssize_t VDIFile::ReadV(uint64_t offset, const struct iovec *iov, int iovcnt)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < iovcnt; i++)
+        count += iov[i].iov_len;
+
+    if (offset >= header->diskSize)
+        return 0;
+    if (count > header->diskSize - offset)
+        count = header->diskSize - offset;
+    if (count == 0)
+        return 0;
+
+    return (this->*readPath)(offset, iov, iovcnt, count);
+}
+
+bool VDIFile::AllocateBlock(uint32_t logicalBlock, bool copyParent)
+{
+    std::lock_guard<std::mutex> lock(allocLock);
+
+    // Another writer may have allocated the block while we waited
+    uint32_t physicalBlock = translationMap[logicalBlock];
+    if (physicalBlock != 0xFFFFFFFF && physicalBlock != 0xFFFFFFFE)
+        return true;
 
-            lseek(fileDescriptor, header->offsetBlocks + (logicalBlock * sizeof(uint32_t)), SEEK_SET);
-            write(fileDescriptor, &translationMap[logicalBlock], sizeof(uint32_t));
+    physicalBlock = header->blocksAllocated;
+    if (!ExtendData(physicalBlock))
+        return false;
+    if (copyParent && !parents.empty() && !CopyFromParent(logicalBlock, physicalBlock))
+        return false;
 
-            lseek(fileDescriptor, 0, SEEK_SET);
-            write(fileDescriptor, header, sizeof(VDIHeader));
+    header->blocksAllocated++;
+    translationMap[logicalBlock] = physicalBlock;
+    SetExtent(logicalBlock, physicalBlock, 0);
 
-            off_t newBlockOffset = header->offsetData + (physicalBlock * blockSize);
-            lseek(fileDescriptor, newBlockOffset, SEEK_SET);
+    // The header and map entry reach the disk at the next Flush
+    headerDirty = true;
+    dirtyMapChunks.insert(logicalBlock / VDI_MAP_CHUNK_ENTRIES);
+    pendingAllocations++;
+
+    if (flushThreshold > 0 && pendingAllocations >= flushThreshold)
+        return FlushLocked();
+    return true;
+}
 
-            uint8_t* zeros = new uint8_t[blockSize];
-            memset(zeros, 0, blockSize);
-            write(fileDescriptor, zeros, blockSize);
-            delete[] zeros;
+bool VDIFile::ExtendData(uint32_t physicalBlock)
+{
+    uint32_t blockSize = header->blockSize;
+    uint64_t start = header->offsetData + static_cast<uint64_t>(physicalBlock) * blockSize;
+    uint64_t end = start + blockSize;
+
+    if (start >= fileSize)
+    {
+        // Fresh space past the end of the file already reads as zeros
+        if (fallocate(fileDescriptor, 0, start, blockSize) != 0 && ftruncate(fileDescriptor, end) != 0)
+        {
+            std::cerr << "Could not extend file descriptor " << fileDescriptor << "\n";
+            return false;
         }
-        off_t physicalOffset = header->offsetData + (physicalBlock * blockSize) + offsetInBlock;
-        lseek(fileDescriptor, physicalOffset, SEEK_SET);
+    }
+    else if (fallocate(fileDescriptor, FALLOC_FL_ZERO_RANGE, start, blockSize) != 0)
+    {
+        // Stale bytes past the last allocated block must be cleared by hand
+        uint8_t* zeros = new uint8_t[blockSize];
+        memset(zeros, 0, blockSize);
+        bool zeroed = PWrite(zeros, blockSize, start);
+        delete[] zeros;
+        if (!zeroed)
+            return false;
+    }
 
-        ssize_t bytesWritten = write(fileDescriptor, buffer, bytesInBlock);
+    if (end > fileSize)
+        fileSize = end;
+    return true;
+}
 
-        if (bytesWritten < 0)
+bool VDIFile::Flush()
+{
+    std::lock_guard<std::mutex> lock(allocLock);
+    return FlushLocked();
+}
+
+bool VDIFile::FlushLocked()
+{
+    // Merge dirty chunks into runs, bridging small clean gaps, and write each run once
+    std::set<uint32_t>::iterator chunk = dirtyMapChunks.begin();
+    while (chunk != dirtyMapChunks.end())
+    {
+        uint32_t firstChunk = *chunk;
+        uint32_t lastChunk = *chunk;
+        for (++chunk; chunk != dirtyMapChunks.end() && *chunk - lastChunk <= VDI_FLUSH_GAP_CHUNKS + 1; ++chunk)
+            lastChunk = *chunk;
+
+        uint32_t firstEntry = firstChunk * VDI_MAP_CHUNK_ENTRIES;
+        uint64_t endEntry = static_cast<uint64_t>(lastChunk + 1) * VDI_MAP_CHUNK_ENTRIES;
+        if (endEntry > header->blocksInHDD)
+            endEntry = header->blocksInHDD;
+
+        if (!PWrite(&translationMap[firstEntry], (endEntry - firstEntry) * sizeof(uint32_t),
+                    header->offsetBlocks + static_cast<uint64_t>(firstEntry) * sizeof(uint32_t)))
+            return false;
+    }
+    dirtyMapChunks.clear();
+
+    if (headerDirty)
+    {
+        if (!PWrite(header, sizeof(VDIHeader), 0))
+            return false;
+        headerDirty = false;
+    }
+
+    pendingAllocations = 0;
+    return true;
+}
+
+bool VDIFile::AllocateRange(uint64_t offset, uint64_t count)
+{
+    if (!translationMap || count == 0)
+        return true;
+
+    uint32_t blockSize = header->blockSize;
+    uint32_t firstBlock = offset / blockSize;
+    uint32_t lastBlock = (offset + count - 1) / blockSize;
+    for (uint32_t logicalBlock = firstBlock; logicalBlock <= lastBlock; logicalBlock++)
+    {
+        // Blocks the range covers completely are about to be overwritten, so
+        // there is no need to copy them up from a parent image
+        uint64_t blockStart = static_cast<uint64_t>(logicalBlock) * blockSize;
+        bool partial = blockStart < offset || blockStart + blockSize > offset + count;
+
+        uint32_t physicalBlock = translationMap[logicalBlock];
+        if ((physicalBlock == 0xFFFFFFFF || physicalBlock == 0xFFFFFFFE) && !AllocateBlock(logicalBlock, partial))
+            return false;
+    }
+    return true;
+}
+
+void VDIFile::DiscardBlock(uint32_t logicalBlock)
+{
+    std::lock_guard<std::mutex> lock(allocLock);
+
+    // The old physical block stays in the file until the image is compacted
+    translationMap[logicalBlock] = 0xFFFFFFFE;
+    SetExtent(logicalBlock, 0xFFFFFFFF, 0);
+    dirtyMapChunks.insert(logicalBlock / VDI_MAP_CHUNK_ENTRIES);
+}
+
+bool VDIFile::WriteRange(uint64_t offset, const struct iovec *iov, int iovcnt, uint64_t count)
+{
+    // Allocate every missing block first, so the whole range maps to data and a
+    // fresh multi-block write lands in consecutive physical blocks
+    if (!AllocateRange(offset, count))
+        return false;
+
+    std::vector<VDISegment> segments;
+    MapRange(offset, count, segments);
+
+    std::vector<struct iovec> pieces;
+    int iovIndex = 0;
+    size_t iovOffset = 0;
+
+    for (const VDISegment &segment : segments)
+    {
+        SliceIovec(iov, iovIndex, iovOffset, segment.length, pieces);
+        if (!DataWriteV(pieces.data(), pieces.size(), segment.fileOffset))
+            return false;
+    }
+    return true;
+}
+
+ssize_t VDIFile::WriteV(uint64_t offset, const struct iovec *iov, int iovcnt)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < iovcnt; i++)
+        count += iov[i].iov_len;
+
+    if (offset >= header->diskSize)
+        return 0;
+    if (count > header->diskSize - offset)
+        count = header->diskSize - offset;
+    if (count == 0)
+        return 0;
+
+    if (!elideZeros || !translationMap)
+        return WriteRange(offset, iov, iovcnt, count) ? static_cast<ssize_t>(count) : -1;
+
+    // Walk the write a block at a time. All-zero pieces that land on a hole are
+    // dropped, and an all-zero write over a whole allocated block turns it back
+    // into a zero block; everything else is gathered into runs for WriteRange.
+    uint32_t blockSize = header->blockSize;
+    std::vector<struct iovec> run, pieces;
+    uint64_t runOffset = offset;
+    uint64_t position = offset;
+    uint64_t end = offset + count;
+    int iovIndex = 0;
+    size_t iovOffset = 0;
+
+    while (position < end)
+    {
+        uint32_t logicalBlock = position / blockSize;
+        uint64_t length = blockSize - position % blockSize;
+        if (length > end - position)
+            length = end - position;
+
+        SliceIovec(iov, iovIndex, iovOffset, length, pieces);
+        bool isZero = true;
+        for (size_t i = 0; isZero && i < pieces.size(); i++)
+            isZero = IsZeroBuffer(pieces[i].iov_base, pieces[i].iov_len);
+
+        uint32_t layer, physicalBlock;
+        ResolveBlock(logicalBlock, layer, physicalBlock);
+        bool hole = physicalBlock == 0xFFFFFFFF;
+
+        if (isZero && (hole || length == blockSize))
         {
-            std::cerr << "Could not write to file descriptor " << fileDescriptor << "\n";
-            return -1;
+            if (!run.empty() && !WriteRange(runOffset, run.data(), run.size(), position - runOffset))
+                return -1;
+            if (!hole)
+                DiscardBlock(logicalBlock);
+            run.clear();
+            runOffset = position + length;
         }
+        else
+            run.insert(run.end(), pieces.begin(), pieces.end());
 
-        cursor += bytesWritten;
-        buffer += bytesWritten;
-        totalWritten += bytesWritten;
-        count -= bytesWritten;
+        position += length;
     }
-    return totalWritten;
+
+    if (!run.empty() && !WriteRange(runOffset, run.data(), run.size(), end - runOffset))
+        return -1;
+    return count;
 }
 
-uint32_t VDIFile::lSeek(uint32_t offset, int anchor)
+uint64_t VDIFile::lSeek(uint64_t offset, int anchor)
 {
     uint64_t newCursor = 0;
     if (anchor == SEEK_SET_)
@@ -194,3 +1240,29 @@ uint32_t VDIFile::lSeek(uint32_t offset, int anchor)
     cursor = newCursor;
     return cursor;
 }
+
+const uint8_t *VDIFile::View(uint64_t offset, size_t count)
+{
+    if (!zeroBlock || offset >= header->diskSize || count > header->diskSize - offset)
+        return nullptr;
+
+    uint32_t blockSize = header->blockSize;
+    uint32_t logicalBlock = offset / blockSize;
+    uint32_t offsetInBlock = offset % blockSize;
+    if (offsetInBlock + count > blockSize)
+        return nullptr;
+
+    uint32_t layer, physicalBlock;
+    ResolveBlock(logicalBlock, layer, physicalBlock);
+
+    if (physicalBlock == 0xFFFFFFFF)
+        return zeroBlock + offsetInBlock;
+    if (layer > 0)
+        return nullptr;
+
+    uint64_t dataOffset = static_cast<uint64_t>(physicalBlock) * blockSize + offsetInBlock;
+    if (dataOffset + count > mappedDataSize)
+        return nullptr;
+
+    return mappedData + dataOffset;
+}
@@ -1,7 +1,16 @@
 #ifndef OS_VDIFILE_H
 #define OS_VDIFILE_H
 
+#include <atomic>
 #include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "VDIBufferPool.h"
 
 struct VDIHeader
 {
@@ -42,20 +51,183 @@ enum
     SEEK_END_
 };
 
+// A piece of a logical range that maps to one contiguous run of the image file
+struct VDISegment
+{
+    uint64_t fileOffset;    // VDI_HOLE for a run of unallocated blocks
+    uint64_t length;
+    uint32_t layer;         // Chain layer whose file holds the run; 0 is the top image
+};
+
+// A run of logical blocks stored in consecutive physical blocks of one layer,
+// or a run of blocks that read as zeros
+struct VDIExtent
+{
+    uint32_t length;            // In blocks
+    uint32_t physicalBlock;     // First physical block, 0xFFFFFFFF for a hole
+    uint32_t layer;             // 0 is the top image, parents count up towards the base
+};
+
+const uint64_t VDI_HOLE = ~0ull;
+
+// Dirty map entries are tracked and written in 512-byte chunks
+const uint32_t VDI_MAP_CHUNK_ENTRIES = 128;
+// Clean chunks between two dirty runs that are cheaper to rewrite than to skip
+const uint32_t VDI_FLUSH_GAP_CHUNKS = 8;
+// Map entries read into the extent index at once with VDI_OPEN_LAZY_MAP, one 4 KiB page
+const uint32_t VDI_INDEX_CHUNK_ENTRIES = 1024;
+// VDI_OPEN_DIRECT transfers start, end and sit in memory on this boundary
+const uint32_t VDI_DIRECT_ALIGNMENT = 4096;
+// Size of the bounce buffers VDI_OPEN_DIRECT uses for unaligned transfers
+const uint32_t VDI_DIRECT_BUFFER_SIZE = 1 << 20;
+
+// Flags for VDIFile::Open
+enum
+{
+    VDI_OPEN_MMAP = 1 << 0,         // Serve reads from a mapping of the block map and data area
+    VDI_OPEN_ELIDE_ZEROS = 1 << 1,  // Drop all-zero writes to unallocated blocks instead of allocating
+    VDI_OPEN_LAZY_MAP = 1 << 2,     // Map the block map instead of reading it and index it a chunk at a time on first use
+    VDI_OPEN_DIRECT = 1 << 3        // Move block data with O_DIRECT, bypassing the page cache
+};
+
 class VDIFile
 {
 private:
     int fileDescriptor;
     unsigned long long int cursor;
+    std::mutex allocLock;   // Serializes block allocation in WriteAt
+    std::atomic<uint32_t> references;
+
+    // VDI_OPEN_MMAP state
+    uint8_t *mapRegion;         // Private mapping holding the translation map
+    size_t mapRegionSize;
+    uint8_t *dataRegion;        // Shared read-only mapping of the data area
+    size_t dataRegionSize;
+    uint8_t *mappedData;        // Start of the data area inside dataRegion
+    uint64_t mappedDataSize;    // Bytes of the data area covered by the mapping
+    uint8_t *zeroBlock;         // One block of the kernel's shared zero page
+
+    bool MapImage(uint64_t fileSize);
+    bool MapTranslationMap();
+    void UnmapImage();
+    bool PRead(void *buf, size_t count, off_t offset);
+    bool PWrite(const void *buf, size_t count, off_t offset);
+    bool PReadV(struct iovec *iov, int iovcnt, off_t offset);
+    bool PWriteV(struct iovec *iov, int iovcnt, off_t offset);
+
+    // VDI_OPEN_DIRECT state. Header and map I/O stays on fileDescriptor; block
+    // data goes through directDescriptor, bounced through bufferPool when the
+    // request is not aligned.
+    int directDescriptor;
+    VDIBufferPool *bufferPool;
+    std::mutex directLock;      // Serializes read-modify-write of partial sectors
+    bool DataReadV(struct iovec *iov, int iovcnt, uint64_t offset);
+    bool DataWriteV(struct iovec *iov, int iovcnt, uint64_t offset);
+    bool ReadAligned(uint8_t *buf, size_t count, uint64_t offset);
+    bool BounceRead(struct iovec *iov, int iovcnt, uint64_t offset);
+    bool BounceWrite(struct iovec *iov, int iovcnt, uint64_t offset);
+    bool AllocateBlock(uint32_t logicalBlock, bool copyParent);
+    bool ExtendData(uint32_t physicalBlock);
+    bool WriteRange(uint64_t offset, const struct iovec *iov, int iovcnt, uint64_t count);
+
+    // Differencing chain state. parents[0] is the direct parent and the base image is last.
+    std::vector<VDIFile*> parents;
+    bool CopyFromParent(uint32_t logicalBlock, uint32_t physicalBlock);
+
+    // Extent index over the whole disk, keyed by first logical block. It merges
+    // the maps of every layer, covers every block exactly once, and keeps
+    // neighbouring extents that continue each other merged.
+    std::map<uint32_t, VDIExtent> extents;
+    std::shared_mutex extentLock;       // Shared by lookups, exclusive for updates
+    // VDI_OPEN_LAZY_MAP state: which VDI_INDEX_CHUNK_ENTRIES-sized chunks are in extents
+    bool lazyMap;
+    std::vector<uint8_t> indexedChunks;
+    void BuildExtentIndex();
+    VDIExtent MapEntry(uint32_t logicalBlock);
+    void IndexBlocks(uint32_t first, uint32_t end);
+    void IndexChunks(uint32_t firstBlock, uint32_t lastBlock);
+    void EnsureIndexed(uint32_t firstBlock, uint32_t lastBlock);
+    std::map<uint32_t, VDIExtent>::iterator MergeExtent(std::map<uint32_t, VDIExtent>::iterator it);
+    void SetExtent(uint32_t logicalBlock, uint32_t physicalBlock, uint32_t layer);
+    void ResolveBlock(uint32_t logicalBlock, uint32_t &layer, uint32_t &physicalBlock);
+
+    // Read path specialized for the layout once Open knows it. A fixed image
+    // without parents maps the disk 1:1 onto its data area; a dynamic image
+    // resolves single-block reads through one lookup, with shift and mask
+    // arithmetic when the block size is a power of two.
+    typedef ssize_t (VDIFile::*ReadPath)(uint64_t offset, const struct iovec *iov, int iovcnt, uint64_t count);
+    ReadPath readPath;
+    uint32_t blockShift;        // log2(blockSize), only meaningful for power-of-two block sizes
+    void SelectReadPath();
+    template <bool Fixed, bool PowerOfTwoBlocks>
+    ssize_t ReadLayout(uint64_t offset, const struct iovec *iov, int iovcnt, uint64_t count);
+    ssize_t ReadSegments(uint64_t offset, const struct iovec *iov, int iovcnt, uint64_t count);
+    bool ReadRun(uint32_t layer, uint64_t fileOffset, struct iovec *iov, int iovcnt, uint64_t count);
+
+    // VDI_OPEN_ELIDE_ZEROS state
+    bool elideZeros;
+    void DiscardBlock(uint32_t logicalBlock);
+
+    uint64_t fileSize;
+    // Metadata changed by allocation and not yet written; see Flush
+    bool headerDirty;
+    std::set<uint32_t> dirtyMapChunks;      // Indexes of VDI_MAP_CHUNK_ENTRIES-sized map chunks
+    uint32_t pendingAllocations;
+    uint32_t flushThreshold;
+    bool FlushLocked();
 public:
     uint32_t *translationMap;
     VDIHeader *header;
 
-    bool Open(char *fn);
+    bool Open(char *fn, int flags = 0);
+    // Creates an empty dynamic image and opens it; model, if given, supplies the UUIDs and geometry
+    bool Create(char *fn, uint64_t diskSize, uint32_t blockSize = 1 << 20, const VDIHeader *model = nullptr);
+    // Creates an empty differencing image on top of parent and opens it on its own
+    bool CreateDiff(char *fn, const VDIHeader *parent);
+    // Opens a differencing chain listed from the base image up to the top one.
+    // Reads resolve each block to the topmost layer that has it allocated;
+    // writes copy the block from its layer into the top image first.
+    bool OpenChain(char **fileNames, int count, int flags = 0);
+    uint32_t GetChainDepth() { return parents.size() + 1; }
+    size_t GetExtentCount() { return extents.size(); }
     void Close();
+    // Shared ownership of a heap-allocated image: Open leaves one reference,
+    // Retain adds one and the last Release closes and deletes the image
+    void Retain() { references++; }
+    void Release();
+    // Writes the header and map entries changed by block allocation since the last flush
+    bool Flush();
+    // Flush automatically after this many allocations; 0 flushes only on Flush and Close
+    void SetFlushThreshold(uint32_t allocations) { flushThreshold = allocations; }
     ssize_t Read(void *buf, size_t count);
     ssize_t Write(void *buf, size_t count);
-    uint32_t lSeek(uint32_t offset, int anchor);
+    // Positional I/O: does not use or move the cursor, safe for concurrent readers
+    ssize_t ReadAt(uint64_t offset, void *buf, size_t count);
+    ssize_t WriteAt(uint64_t offset, const void *buf, size_t count);
+    // Scatter-gather I/O; physically contiguous blocks are merged into one preadv/pwritev
+    ssize_t ReadV(uint64_t offset, const struct iovec *iov, int iovcnt);
+    ssize_t WriteV(uint64_t offset, const struct iovec *iov, int iovcnt);
+
+    // Allocates every unallocated block touched by [offset, offset + count)
+    bool AllocateRange(uint64_t offset, uint64_t count);
+    int GetFileDescriptor(uint32_t layer = 0) { return layer == 0 ? fileDescriptor : parents[layer - 1]->fileDescriptor; }
+    // Descriptor block data is moved through; opened with O_DIRECT under VDI_OPEN_DIRECT
+    int GetDataDescriptor(uint32_t layer = 0)
+    {
+        VDIFile *image = layer == 0 ? this : parents[layer - 1];
+        return image->directDescriptor >= 0 ? image->directDescriptor : image->fileDescriptor;
+    }
+    // Aligned buffers for O_DIRECT transfers; nullptr without VDI_OPEN_DIRECT
+    VDIBufferPool *GetBufferPool() { return bufferPool; }
+
+    // Splits [offset, offset + count) into runs of contiguous file data and holes,
+    // in O(log n) in the number of extents plus one step per segment
+    void MapRange(uint64_t offset, uint64_t count, std::vector<VDISegment> &segments);
+    uint64_t lSeek(uint64_t offset, int anchor);
+
+    // Zero-copy view of count bytes at offset, valid until Close. Only available
+    // with VDI_OPEN_MMAP and when the range does not cross a block; nullptr otherwise.
+    const uint8_t *View(uint64_t offset, size_t count);
 };
 
 #endif
@@ -1,7 +1,10 @@
 #include <iostream>
 #include <cstring>
 #include <iomanip>
+#include <thread>
+#include <vector>
 #include "VDIFile.h"
+#include "VDIAsyncIO.h"
 
 void DisplayBufferPage(uint8_t *buf, uint32_t count, uint32_t skip, uint64_t offset)
 {
@@ -82,9 +85,133 @@ void TestVDIRead(VDIFile *vdi, size_t count)
         std::cerr << "Read: Failed" << std::endl;
 }
 
-void TestVDISeek(VDIFile *vdi, uint32_t offset, int anchor)
+void TestVDIReadAt(VDIFile *vdi, uint64_t offset, size_t count)
 {
-    uint32_t newPos = vdi->lSeek(offset, anchor);
+    uint8_t buffer[count];
+    ssize_t bytesRead = vdi->ReadAt(offset, buffer, count);
+
+    DisplayBuffer(buffer, count, offset);
+
+    if (bytesRead > 0)
+        std::cout << "ReadAt: Read " << bytesRead << " bytes" << std::endl;
+    else
+        std::cerr << "ReadAt: Failed" << std::endl;
+}
+
+void TestVDIConcurrentReadAt(VDIFile *vdi, uint64_t offset, size_t count, int threads)
+{
+    std::vector<uint8_t> expected(count);
+    if (vdi->ReadAt(offset, expected.data(), count) != static_cast<ssize_t>(count))
+    {
+        std::cerr << "ConcurrentReadAt: Failed" << std::endl;
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    std::vector<int> matches(threads, 0);
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]()
+        {
+            std::vector<uint8_t> buffer(count);
+            for (int i = 0; i < 100; i++)
+            {
+                if (vdi->ReadAt(offset, buffer.data(), count) == static_cast<ssize_t>(count) &&
+                    memcmp(buffer.data(), expected.data(), count) == 0)
+                    matches[t]++;
+            }
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+
+    int total = 0;
+    for (int m : matches)
+        total += m;
+
+    if (total == threads * 100)
+        std::cout << "ConcurrentReadAt: " << threads << " threads matched" << std::endl;
+    else
+        std::cerr << "ConcurrentReadAt: Failed, " << total << " of " << threads * 100 << " reads matched" << std::endl;
+}
+
+void TestVDIMappedRead(const char *filePath, uint64_t offset, size_t count)
+{
+    VDIFile mapped, plain;
+    if (!mapped.Open(const_cast<char *>(filePath), VDI_OPEN_MMAP) || !plain.Open(const_cast<char *>(filePath)))
+    {
+        std::cerr << "MappedRead: Open failed" << std::endl;
+        return;
+    }
+
+    std::vector<uint8_t> a(count), b(count);
+    ssize_t bytesRead = mapped.ReadAt(offset, a.data(), count);
+    plain.ReadAt(offset, b.data(), count);
+
+    const uint8_t *view = mapped.View(offset, count);
+    if (bytesRead == static_cast<ssize_t>(count) && memcmp(a.data(), b.data(), count) == 0 &&
+        (!view || memcmp(view, b.data(), count) == 0))
+        std::cout << "MappedRead: Matched " << count << " bytes" << (view ? " (zero-copy view)" : "") << std::endl;
+    else
+        std::cerr << "MappedRead: Failed" << std::endl;
+
+    mapped.Close();
+    plain.Close();
+}
+
+void TestVDIReadV(VDIFile *vdi, uint64_t offset, size_t count)
+{
+    std::vector<VDISegment> segments;
+    vdi->MapRange(offset, count, segments);
+
+    // Scatter into two halves and compare against a plain ReadAt
+    std::vector<uint8_t> expected(count), scattered(count);
+    struct iovec iov[2] = {{scattered.data(), count / 2}, {scattered.data() + count / 2, count - count / 2}};
+    ssize_t bytesRead = vdi->ReadV(offset, iov, 2);
+    vdi->ReadAt(offset, expected.data(), count);
+
+    if (bytesRead == static_cast<ssize_t>(count) && memcmp(expected.data(), scattered.data(), count) == 0)
+        std::cout << "ReadV: Read " << bytesRead << " bytes in " << segments.size() << " segments" << std::endl;
+    else
+        std::cerr << "ReadV: Failed" << std::endl;
+}
+
+void TestVDIAsyncRead(VDIFile *vdi, size_t count, int requests)
+{
+    VDIAsyncIO engine;
+    engine.Start(vdi);
+    std::cout << "AsyncRead: Using " << (engine.UsingIoUring() ? "io_uring" : "thread pool") << std::endl;
+
+    std::vector<std::vector<uint8_t>> buffers(requests, std::vector<uint8_t>(count));
+    std::vector<VDIAsyncRequest> batch;
+    int failures = 0;
+    for (int i = 0; i < requests; i++)
+    {
+        uint64_t offset = (static_cast<uint64_t>(i) * 7919 * count) % (vdi->header->diskSize - count);
+        batch.push_back({false, offset, buffers[i].data(), count,
+                         [&failures, count](ssize_t result) { if (result != static_cast<ssize_t>(count)) failures++; }});
+    }
+    engine.Submit(batch.data(), requests);
+    engine.Wait();
+
+    std::vector<uint8_t> expected(count);
+    for (int i = 0; i < requests; i++)
+    {
+        vdi->ReadAt(batch[i].offset, expected.data(), count);
+        if (memcmp(expected.data(), buffers[i].data(), count) != 0)
+            failures++;
+    }
+    engine.Stop();
+
+    if (failures == 0)
+        std::cout << "AsyncRead: " << requests << " requests matched" << std::endl;
+    else
+        std::cerr << "AsyncRead: Failed, " << failures << " mismatches" << std::endl;
+}
+
+void TestVDISeek(VDIFile *vdi, uint64_t offset, int anchor)
+{
+    uint64_t newPos = vdi->lSeek(offset, anchor);
     std::cout << "lSeek: New position = " << newPos << std::endl;
 }
 
@@ -100,6 +227,252 @@ void TestVDIWrite(VDIFile *vdi)
         std::cerr << "Write: Failed" << std::endl;
 }
 
+void TestVDISparseWrite(VDIFile *vdi, uint64_t offset)
+{
+    uint32_t allocatedBefore = vdi->header->blocksAllocated;
+    uint8_t pattern[4] = {0xDE, 0xAD, 0xBE, 0xEF};
+    uint8_t readBack[4] = {0};
+
+    ssize_t bytesWritten = vdi->WriteAt(offset, pattern, sizeof(pattern));
+    bool flushed = vdi->Flush();
+    vdi->ReadAt(offset, readBack, sizeof(readBack));
+
+    if (bytesWritten == sizeof(pattern) && flushed && memcmp(pattern, readBack, sizeof(pattern)) == 0)
+        std::cout << "SparseWrite: Wrote " << bytesWritten << " bytes, blocks allocated "
+                  << allocatedBefore << " -> " << vdi->header->blocksAllocated << std::endl;
+    else
+        std::cerr << "SparseWrite: Failed" << std::endl;
+}
+
+void TestVDIBatchedFlush(const char *filePath, uint32_t threshold, uint32_t writes)
+{
+    VDIFile writer, observer;
+    if (!writer.Open(const_cast<char *>(filePath)))
+    {
+        std::cerr << "BatchedFlush: Open failed" << std::endl;
+        return;
+    }
+    writer.SetFlushThreshold(threshold);
+
+    uint32_t allocatedBefore = writer.header->blocksAllocated;
+    uint8_t value = 0x5A;
+    uint64_t stride = writer.header->diskSize / writes;
+    for (uint32_t i = 0; i < writes; i++)
+        writer.WriteAt(i * stride, &value, 1);
+
+    // A second handle only sees what the threshold flushes have written so far
+    observer.Open(const_cast<char *>(filePath));
+    std::cout << "BatchedFlush: " << writer.header->blocksAllocated - allocatedBefore << " allocations, "
+              << observer.header->blocksAllocated - allocatedBefore << " on disk before Close" << std::endl;
+    observer.Close();
+    writer.Close();
+}
+
+void TestVDILargeOffsets(const char *filePath)
+{
+    // Sparse 8 GiB image: only the blocks touched below are allocated on disk
+    VDIFile vdi;
+    if (!vdi.Create(const_cast<char *>(filePath), 8ull << 30))
+    {
+        std::cerr << "LargeOffsets: Create failed" << std::endl;
+        return;
+    }
+
+    uint64_t offsets[] = {(4ull << 30) - 2, 5ull << 30, (8ull << 30) - 8};
+    uint8_t pattern[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    for (uint64_t offset : offsets)
+        vdi.WriteAt(offset, pattern, sizeof(pattern));
+    vdi.lSeek(6ull << 30, SEEK_SET_);
+    vdi.Write(pattern, sizeof(pattern));
+    vdi.Close();
+
+    bool matched = vdi.Open(const_cast<char *>(filePath));
+    uint8_t readBack[8];
+    for (uint64_t offset : offsets)
+    {
+        memset(readBack, 0, sizeof(readBack));
+        if (vdi.ReadAt(offset, readBack, sizeof(readBack)) != sizeof(readBack) || memcmp(readBack, pattern, sizeof(pattern)) != 0)
+            matched = false;
+    }
+    if (vdi.lSeek(6ull << 30, SEEK_SET_) != 6ull << 30 || vdi.Read(readBack, sizeof(readBack)) != sizeof(readBack) ||
+        memcmp(readBack, pattern, sizeof(pattern)) != 0)
+        matched = false;
+
+    if (matched)
+        std::cout << "LargeOffsets: Matched above 4 GiB, " << vdi.header->blocksAllocated << " blocks allocated" << std::endl;
+    else
+        std::cerr << "LargeOffsets: Failed" << std::endl;
+    vdi.Close();
+}
+
+void TestVDIZeroElision(const char *filePath)
+{
+    VDIFile vdi;
+    if (!vdi.Create(const_cast<char *>(filePath), 16ull << 20))
+    {
+        std::cerr << "ZeroElision: Create failed" << std::endl;
+        return;
+    }
+    vdi.Close();
+    if (!vdi.Open(const_cast<char *>(filePath), VDI_OPEN_ELIDE_ZEROS))
+    {
+        std::cerr << "ZeroElision: Open failed" << std::endl;
+        return;
+    }
+
+    // Two zero blocks around one block of data: only the middle one is allocated
+    uint32_t blockSize = vdi.header->blockSize;
+    std::vector<uint8_t> buf(3ull * blockSize, 0);
+    memset(&buf[blockSize], 0xA5, blockSize);
+    vdi.WriteAt(0, buf.data(), buf.size());
+    uint32_t allocated = vdi.header->blocksAllocated;
+
+    std::vector<uint8_t> readBack(buf.size(), 0xFF);
+    vdi.ReadAt(0, readBack.data(), readBack.size());
+
+    if (allocated == 1 && readBack == buf)
+        std::cout << "ZeroElision: 3 blocks written, " << allocated << " allocated" << std::endl;
+    else
+        std::cerr << "ZeroElision: Failed" << std::endl;
+    vdi.Close();
+}
+
+void TestVDIChain(const char *basePath, const char *diffPath, uint64_t offset)
+{
+    VDIFile base;
+    if (!base.Open(const_cast<char *>(basePath)))
+    {
+        std::cerr << "Chain: Open failed" << std::endl;
+        return;
+    }
+    uint8_t original[16];
+    base.ReadAt(offset, original, sizeof(original));
+    VDIHeader baseHeader = *base.header;
+    base.Close();
+
+    VDIFile diff;
+    if (!diff.CreateDiff(const_cast<char *>(diffPath), &baseHeader))
+    {
+        std::cerr << "Chain: CreateDiff failed" << std::endl;
+        return;
+    }
+    diff.Close();
+
+    // Overwrite half of the range through the chain; the other half still comes from the base
+    char *chain[] = {const_cast<char *>(basePath), const_cast<char *>(diffPath)};
+    VDIFile vdi;
+    if (!vdi.OpenChain(chain, 2))
+    {
+        std::cerr << "Chain: OpenChain failed" << std::endl;
+        return;
+    }
+    uint8_t pattern[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t expected[16];
+    memcpy(expected, pattern, sizeof(pattern));
+    memcpy(expected + 8, original + 8, 8);
+    vdi.WriteAt(offset, pattern, sizeof(pattern));
+
+    uint8_t readBack[16];
+    vdi.ReadAt(offset, readBack, sizeof(readBack));
+    base.Open(const_cast<char *>(basePath));
+    uint8_t baseAfter[16];
+    base.ReadAt(offset, baseAfter, sizeof(baseAfter));
+
+    if (memcmp(readBack, expected, sizeof(expected)) == 0 && memcmp(baseAfter, original, sizeof(original)) == 0)
+        std::cout << "Chain: Depth " << vdi.GetChainDepth() << ", write copied up, base unchanged" << std::endl;
+    else
+        std::cerr << "Chain: Failed" << std::endl;
+    base.Close();
+    vdi.Close();
+}
+
+void TestVDIExtents(VDIFile *vdi)
+{
+    std::vector<VDISegment> segments;
+    vdi->MapRange(0, vdi->header->diskSize, segments);
+
+    uint64_t mapped = 0, holes = 0;
+    for (const VDISegment &segment : segments)
+    {
+        if (segment.fileOffset == VDI_HOLE)
+            holes += segment.length;
+        else
+            mapped += segment.length;
+    }
+
+    if (mapped + holes == vdi->header->diskSize && segments.size() == vdi->GetExtentCount())
+        std::cout << "Extents: " << vdi->GetExtentCount() << " extents, " << mapped << " bytes mapped, "
+                  << holes << " bytes in holes" << std::endl;
+    else
+        std::cerr << "Extents: Failed" << std::endl;
+}
+
+void TestVDILazyMap(const char *filePath, uint64_t offset, uint64_t count)
+{
+    VDIFile eager, lazy;
+    if (!eager.Open(const_cast<char *>(filePath)) || !lazy.Open(const_cast<char *>(filePath), VDI_OPEN_LAZY_MAP))
+    {
+        std::cerr << "LazyMap: Open failed" << std::endl;
+        return;
+    }
+
+    // The lazy handle only indexes the chunks of the map the range touches
+    size_t indexedAtOpen = lazy.GetExtentCount();
+    std::vector<VDISegment> expected, actual;
+    eager.MapRange(offset, count, expected);
+    lazy.MapRange(offset, count, actual);
+
+    bool matched = expected.size() == actual.size();
+    for (size_t i = 0; matched && i < expected.size(); i++)
+        matched = expected[i].fileOffset == actual[i].fileOffset && expected[i].length == actual[i].length;
+
+    if (matched)
+        std::cout << "LazyMap: " << indexedAtOpen << " extents at open, " << lazy.GetExtentCount() << " after mapping "
+                  << count << " bytes (" << eager.GetExtentCount() << " when read eagerly)" << std::endl;
+    else
+        std::cerr << "LazyMap: Failed" << std::endl;
+    lazy.Close();
+    eager.Close();
+}
+
+void TestVDIDirectRead(const char *filePath, uint64_t offset, size_t count)
+{
+    VDIFile buffered, direct;
+    if (!buffered.Open(const_cast<char *>(filePath)) || !direct.Open(const_cast<char *>(filePath), VDI_OPEN_DIRECT))
+    {
+        std::cerr << "DirectRead: Open failed" << std::endl;
+        return;
+    }
+
+    // An odd offset and plain vector storage force the bounce-buffer path
+    std::vector<uint8_t> expected(count), actual(count);
+    buffered.ReadAt(offset, expected.data(), count);
+    ssize_t bytesRead = direct.ReadAt(offset, actual.data(), count);
+
+    if (bytesRead == static_cast<ssize_t>(count) && expected == actual)
+        std::cout << "DirectRead: Matched " << bytesRead << " bytes at offset " << offset << std::endl;
+    else
+        std::cerr << "DirectRead: Failed" << std::endl;
+    direct.Close();
+    buffered.Close();
+}
+
+void TestVDIReadPaths(VDIFile *vdi, uint64_t offset, size_t count)
+{
+    // One wide read crosses blocks and takes the segment path; sector-sized
+    // reads stay inside a block and take the single-lookup path
+    std::vector<uint8_t> wide(count), narrow(count);
+    ssize_t bytesRead = vdi->ReadAt(offset, wide.data(), count);
+    for (size_t done = 0; done < count; done += 512)
+        vdi->ReadAt(offset + done, narrow.data() + done, count - done < 512 ? count - done : 512);
+
+    if (bytesRead == static_cast<ssize_t>(count) && wide == narrow)
+        std::cout << "ReadPaths: Matched " << bytesRead << " bytes on a "
+                  << (vdi->translationMap ? "dynamic" : "fixed") << " image" << std::endl;
+    else
+        std::cerr << "ReadPaths: Failed" << std::endl;
+}
+
 void PrintUUID(uint8_t uuid[16])
 {
     for (int i = 0; i < 16; i++)
@@ -153,6 +526,20 @@ int main()
 //        TestVDISeek(vdi, 16, SEEK_SET_);
 //        TestVDISeek(vdi, 16, SEEK_CUR_);
 //        TestVDIRead(vdi, 32);
+//        TestVDIReadAt(vdi, 0x1BE, 64);
+//        TestVDIConcurrentReadAt(vdi, 0, 64 * 1024, 8);
+//        TestVDIMappedRead(filename, 0, 4096);
+//        TestVDIReadV(vdi, 0, vdi->header->diskSize);
+//        TestVDIAsyncRead(vdi, 4096, 256);
+//        TestVDISparseWrite(vdi, vdi->header->diskSize - 4);
+//        TestVDIBatchedFlush(filename, 16, 64);
+//        TestVDILargeOffsets("c:/dev/cpp/OS-project/vdi-files/large-sparse.vdi");
+//        TestVDIExtents(vdi);
+//        TestVDILazyMap(filename, 0, 4 * 1024 * 1024);
+//        TestVDIDirectRead(filename, 0x1BE, 64 * 1024);
+//        TestVDIReadPaths(vdi, 0x1BE, 256 * 1024);
+//        TestVDIZeroElision("c:/dev/cpp/OS-project/vdi-files/zero-elision.vdi");
+//        TestVDIChain("c:/dev/cpp/OS-project/vdi-files/good-dynamic-1k-copy.vdi", "c:/dev/cpp/OS-project/vdi-files/snapshot-1.vdi", 0x1BE);
         DisplayBuffer(reinterpret_cast<uint8_t *>(vdi->translationMap), vdi->header->blocksInHDD * 4, 0);
 
         vdi->Close();
@@ -0,0 +1,81 @@
+#include <cstdint>
+#include <cstring>
+#include "ZeroDetect.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZERO_DETECT_X86 1
+#endif
+
+static bool IsZeroScalar(const uint8_t *buf, size_t count)
+{
+    uint64_t accumulator = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        accumulator |= word;
+    }
+    for (; i < count; i++)
+        accumulator |= buf[i];
+
+    return accumulator == 0;
+}
+
+#ifdef ZERO_DETECT_X86
+__attribute__((target("sse2")))
+static bool IsZeroSSE2(const uint8_t *buf, size_t count)
+{
+    size_t i = 0;
+    for (; i + 64 <= count; i += 64)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i + 32));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF)
+            return false;
+    }
+    return IsZeroScalar(buf + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static bool IsZeroAVX2(const uint8_t *buf, size_t count)
+{
+    size_t i = 0;
+    for (; i + 128 <= count; i += 128)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i + 32));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i + 64));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i + 96));
+        __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(any, any))
+            return false;
+    }
+    return IsZeroScalar(buf + i, count - i);
+}
+#endif
+
+typedef bool (*ZeroKernel)(const uint8_t *, size_t);
+
+static ZeroKernel SelectKernel()
+{
+#ifdef ZERO_DETECT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return IsZeroAVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return IsZeroSSE2;
+#endif
+    return IsZeroScalar;
+}
+
+bool IsZeroBuffer(const void *buf, size_t count)
+{
+    static const ZeroKernel kernel = SelectKernel();
+    return kernel(reinterpret_cast<const uint8_t*>(buf), count);
+}
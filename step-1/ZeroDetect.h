@@ -0,0 +1,10 @@
+#ifndef OS_ZERODETECT_H
+#define OS_ZERODETECT_H
+
+#include <cstddef>
+
+// True when every byte of buf is zero. Uses AVX2 or SSE2 when the CPU has them,
+// otherwise a word-at-a-time scalar loop.
+bool IsZeroBuffer(const void *buf, size_t count);
+
+#endif
@@ -0,0 +1,265 @@
+#ifndef OS_PROJECT_BLOCKDEVICE_H
+#define OS_PROJECT_BLOCKDEVICE_H
+
+#include <concepts>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "../step-1/VDIFile.h"
+
+// Anything that moves bytes at positional offsets. Layers are templates over
+// the device below them, so a stack such as PartitionWindow<VDIDevice> compiles
+// down to one offset translation and a direct call into the bottom device.
+template <typename T>
+concept BlockDevice = requires(T &device, uint64_t offset, void *buf, const void *data, size_t count)
+{
+    { device.ReadAt(offset, buf, count) } -> std::same_as<ssize_t>;
+    { device.WriteAt(offset, data, count) } -> std::same_as<ssize_t>;
+    { device.Size() } -> std::convertible_to<uint64_t>;
+};
+
+// A plain file or host block device
+class RawDevice
+{
+private:
+    int fileDescriptor;
+    uint64_t size;
+public:
+    bool Open(char *fn)
+    {
+        fileDescriptor = open(fn, O_RDWR);
+        if (fileDescriptor < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fileDescriptor, &st) < 0)
+        {
+            Close();
+            return false;
+        }
+        size = st.st_size;
+        return true;
+    }
+
+    void Close()
+    {
+        if (fileDescriptor >= 0)
+        {
+            close(fileDescriptor);
+            fileDescriptor = -1;
+        }
+    }
+
+    ssize_t ReadAt(uint64_t offset, void *buf, size_t count)
+    {
+        ssize_t bytesRead;
+        do
+            bytesRead = pread(fileDescriptor, buf, count, offset);
+        while (bytesRead < 0 && errno == EINTR);
+        return bytesRead;
+    }
+
+    ssize_t WriteAt(uint64_t offset, const void *buf, size_t count)
+    {
+        ssize_t bytesWritten;
+        do
+            bytesWritten = pwrite(fileDescriptor, buf, count, offset);
+        while (bytesWritten < 0 && errno == EINTR);
+        return bytesWritten;
+    }
+
+    uint64_t Size() { return size; }
+};
+
+// The logical disk of an open VDIFile; holds a reference to it while open
+class VDIDevice
+{
+private:
+    VDIFile *vdi;
+public:
+    bool Open(VDIFile *image)
+    {
+        vdi = image;
+        vdi->Retain();
+        return true;
+    }
+
+    void Close()
+    {
+        if (vdi)
+        {
+            vdi->Release();
+            vdi = nullptr;
+        }
+    }
+
+    ssize_t ReadAt(uint64_t offset, void *buf, size_t count) { return vdi->ReadAt(offset, buf, count); }
+    ssize_t WriteAt(uint64_t offset, const void *buf, size_t count) { return vdi->WriteAt(offset, buf, count); }
+    uint64_t Size() { return vdi->header->diskSize; }
+};
+
+// Bytes [start, start + size) of the device below, addressed from 0. Transfers
+// are clipped to the window; offsets at or past its end transfer nothing.
+template <BlockDevice Lower>
+class PartitionWindow
+{
+private:
+    Lower *lower;
+    uint64_t start;
+    uint64_t size;
+public:
+    bool Open(Lower *device, uint64_t offset, uint64_t length)
+    {
+        if (offset > device->Size() || length > device->Size() - offset)
+            return false;
+        lower = device;
+        start = offset;
+        size = length;
+        return true;
+    }
+
+    // A window inside another window of the same device folds both offsets
+    // into one, so nesting adds no layer to the read path
+    bool Open(PartitionWindow<Lower> *outer, uint64_t offset, uint64_t length)
+    {
+        if (offset > outer->size || length > outer->size - offset)
+            return false;
+        lower = outer->lower;
+        start = outer->start + offset;
+        size = length;
+        return true;
+    }
+
+    ssize_t ReadAt(uint64_t offset, void *buf, size_t count)
+    {
+        if (offset >= size)
+            return 0;
+        if (count > size - offset)
+            count = size - offset;
+        return lower->ReadAt(start + offset, buf, count);
+    }
+
+    ssize_t WriteAt(uint64_t offset, const void *buf, size_t count)
+    {
+        if (offset >= size)
+            return 0;
+        if (count > size - offset)
+            count = size - offset;
+        return lower->WriteAt(start + offset, buf, count);
+    }
+
+    uint64_t Size() { return size; }
+    uint64_t Start() { return start; }
+};
+
+// Direct-mapped write-through cache of BlockSize-aligned blocks. Only reads of
+// exactly one aligned block are cached; other transfers go straight through.
+template <BlockDevice Lower, uint32_t BlockSize = 1024, uint32_t Slots = 256>
+class CachedDevice
+{
+private:
+    Lower *lower;
+    uint64_t tags[Slots];       // Block number + 1 held by each slot, 0 when empty
+    uint8_t *data;
+    std::mutex cacheLock;
+public:
+    uint64_t hits;
+    uint64_t misses;
+
+    bool Open(Lower *device)
+    {
+        lower = device;
+        data = new uint8_t[static_cast<size_t>(Slots) * BlockSize];
+        memset(tags, 0, sizeof(tags));
+        hits = 0;
+        misses = 0;
+        return true;
+    }
+
+    void Close()
+    {
+        delete[] data;
+        data = nullptr;
+    }
+
+    ssize_t ReadAt(uint64_t offset, void *buf, size_t count)
+    {
+        if (count != BlockSize || offset % BlockSize != 0)
+            return lower->ReadAt(offset, buf, count);
+
+        uint64_t block = offset / BlockSize;
+        uint8_t *slot = data + (block % Slots) * BlockSize;
+        std::lock_guard<std::mutex> lock(cacheLock);
+        if (tags[block % Slots] == block + 1)
+        {
+            hits++;
+            memcpy(buf, slot, BlockSize);
+            return BlockSize;
+        }
+
+        misses++;
+        ssize_t bytesRead = lower->ReadAt(offset, slot, BlockSize);
+        tags[block % Slots] = bytesRead == BlockSize ? block + 1 : 0;
+        if (bytesRead > 0)
+            memcpy(buf, slot, bytesRead);
+        return bytesRead;
+    }
+
+    ssize_t WriteAt(uint64_t offset, const void *buf, size_t count)
+    {
+        std::lock_guard<std::mutex> lock(cacheLock);
+        ssize_t bytesWritten = lower->WriteAt(offset, buf, count);
+
+        // Drop every cached block the write touched
+        if (count == 0)
+            return bytesWritten;
+        uint64_t first = offset / BlockSize;
+        uint64_t last = (offset + count - 1) / BlockSize;
+        if (last - first >= Slots)
+            memset(tags, 0, sizeof(tags));
+        for (uint64_t block = first; block <= last && last - first < Slots; block++)
+        {
+            if (tags[block % Slots] == block + 1)
+                tags[block % Slots] = 0;
+        }
+        return bytesWritten;
+    }
+
+    uint64_t Size() { return lower->Size(); }
+};
+
+// Runtime composition: any stack can be put behind this interface when its
+// shape is only known at run time. AnyBlockDevice is itself a BlockDevice, so
+// templated layers can also sit on top of it.
+class AnyBlockDevice
+{
+public:
+    virtual ~AnyBlockDevice() {}
+    virtual ssize_t ReadAt(uint64_t offset, void *buf, size_t count) = 0;
+    virtual ssize_t WriteAt(uint64_t offset, const void *buf, size_t count) = 0;
+    virtual uint64_t Size() = 0;
+};
+
+template <BlockDevice Device>
+class BlockDeviceAdapter : public AnyBlockDevice
+{
+public:
+    Device device;
+
+    ssize_t ReadAt(uint64_t offset, void *buf, size_t count) override { return device.ReadAt(offset, buf, count); }
+    ssize_t WriteAt(uint64_t offset, const void *buf, size_t count) override { return device.WriteAt(offset, buf, count); }
+    uint64_t Size() override { return device.Size(); }
+};
+
+static_assert(BlockDevice<RawDevice>);
+static_assert(BlockDevice<VDIDevice>);
+static_assert(BlockDevice<PartitionWindow<VDIDevice>>);
+static_assert(BlockDevice<CachedDevice<PartitionWindow<VDIDevice>>>);
+static_assert(BlockDevice<AnyBlockDevice>);
+
+#endif
@@ -4,21 +4,33 @@
 
 bool MBRPartition::Open(char *fn, int part)
 {
-    vdi = new VDIFile;
-    if (!vdi->Open(fn))
+    readAheadIO = nullptr;
+    readAheadHits = 0;
+    vdi = nullptr;
+
+    VDIFile *image = new VDIFile;
+    if (!image->Open(fn))
     {
-        delete vdi;
-        vdi = nullptr;
+        delete image;
         return false;
     }
 
+    // The partition takes its own reference; drop the one Open left
+    bool opened = Open(image, part);
+    image->Release();
+    return opened;
+}
+
+bool MBRPartition::Open(VDIFile *image, int part)
+{
+    readAheadIO = nullptr;
+    readAheadHits = 0;
+    vdi = nullptr;
+
     uint8_t mbr[512];
-    if (vdi->Read(mbr, 512) != 512)
+    if (image->ReadAt(0, mbr, 512) != 512)
     {
-        std::cerr << "Failed to open. Could not read file " << fn << "\n";
-        vdi->Close();
-        delete vdi;
-        vdi = nullptr;
+        std::cerr << "Failed to open. Could not read the partition table" << "\n";
         return false;
     }
 
@@ -30,84 +42,159 @@ bool MBRPartition::Open(char *fn, int part)
     if (part < 0 || part > 3)
     {
         std::cerr << "Failed to open. Invalid partition " << part << "\n";
-        Close();
         return false;
     }
+    return Attach(image, static_cast<uint64_t>(partitionTable[part].firstSector) * 512,
+                  static_cast<uint64_t>(partitionTable[part].totalSectors) * 512);
+}
+
+bool MBRPartition::Open(MBRPartition *sibling, int part)
+{
+    readAheadIO = nullptr;
+    readAheadHits = 0;
+    vdi = nullptr;
+
+    memcpy(partitionTable, sibling->partitionTable, sizeof(partitionTable));
+    if (part < 0 || part > 3)
+    {
+        std::cerr << "Failed to open. Invalid partition " << part << "\n";
+        return false;
+    }
+    return Attach(sibling->vdi, static_cast<uint64_t>(partitionTable[part].firstSector) * 512,
+                  static_cast<uint64_t>(partitionTable[part].totalSectors) * 512);
+}
+
+bool MBRPartition::Open(PartitionMap *map, uint32_t index)
+{
+    readAheadIO = nullptr;
+    readAheadHits = 0;
+    vdi = nullptr;
+
+    memcpy(partitionTable, map->primary, sizeof(partitionTable));
+    if (index >= map->GetCount())
+    {
+        std::cerr << "Failed to open. Invalid partition " << index << "\n";
+        return false;
+    }
+    const PartitionInfo &info = map->Get(index);
+    return Attach(map->vdi, info.offset, info.size);
+}
 
-    PartitionEntry selected = partitionTable[part];
+bool MBRPartition::Attach(VDIFile *image, uint64_t offset, uint64_t size)
+{
+    vdi = image;
+    vdi->Retain();
 
-    partitionOffset = selected.firstSector * 512;
-    partitionSize = selected.totalSectors * 512;
+    partitionOffset = offset;
+    partitionSize = size;
 
     cursor = 0;
 
     return true;
 }
 
+int MBRPartition::FindPartition(uint8_t partitionType)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        if (partitionTable[i].partitionType == partitionType)
+            return i;
+    }
+    return -1;
+}
+
 void MBRPartition::Close()
 {
+    DisableReadAhead();
     if (vdi)
     {
-        vdi->Close();
-        delete vdi;
+        vdi->Release();
         vdi = nullptr;
     }
 }
 
 ssize_t MBRPartition::Read(void *buf, size_t count)
 {
-    if (cursor >= partitionSize)
+    ssize_t bytesRead = ReadAt(cursor, buf, count);
+    if (bytesRead > 0)
+        cursor += bytesRead;
+    return bytesRead;
+}
+
+ssize_t MBRPartition::Write(void *buf, size_t count)
+{
+    ssize_t bytesWritten = WriteAt(cursor, buf, count);
+    if (bytesWritten > 0)
+        cursor += bytesWritten;
+    return bytesWritten;
+}
+
+ssize_t MBRPartition::ReadAt(uint64_t offset, void *buf, size_t count)
+{
+    if (offset >= partitionSize)
     {
-        std::cerr << "Cursor outside partition" << "\n";
+        std::cerr << "Offset outside partition" << "\n";
         return 0;
     }
 
-    if (cursor + count > partitionSize)
-        count = partitionSize - cursor;
+    if (count > partitionSize - offset)
+        count = partitionSize - offset;
 
-    off_t absoluteOffset = partitionOffset + cursor;
-    if (vdi->lSeek(static_cast<uint32_t>(absoluteOffset), SEEK_SET_) != static_cast<uint32_t>(absoluteOffset))
+    if (readAheadIO)
     {
-        std::cerr << "Failed to set cursor in VDI" << "\n";
-        return -1;
+        std::lock_guard<std::mutex> lock(readAheadLock);
+
+        bool sequential = offset == streamEnd;
+        streamEnd = offset + count;
+        if (sequential)
+            window = window == 0 ? minWindow : (window * 2 < maxWindow ? window * 2 : maxWindow);
+        else
+            window = window / 2 < minWindow ? 0 : window / 2;
+
+        bool hit = ReadFromStaging(offset, buf, count);
+        if (window > 0)
+            Prefetch(streamEnd);
+        if (hit)
+        {
+            readAheadHits++;
+            return count;
+        }
     }
-    ssize_t bytesRead = vdi->Read(buf, count);
+
+    ssize_t bytesRead = vdi->ReadAt(partitionOffset + offset, buf, count);
     if (bytesRead < 0)
     {
         std::cerr << "Failed to read from VDI" << "\n";
         return -1;
     }
 
-    cursor += bytesRead;
     return bytesRead;
 }
 
-ssize_t MBRPartition::Write(void *buf, size_t count)
+ssize_t MBRPartition::WriteAt(uint64_t offset, const void *buf, size_t count)
 {
-    if (cursor >= partitionSize)
+    if (offset >= partitionSize)
     {
-        std::cerr << "Cursor outside partition" << "\n";
+        std::cerr << "Offset outside partition" << "\n";
         return 0;
     }
 
-    if (cursor + count > partitionSize)
-        count = partitionSize - cursor;
+    if (count > partitionSize - offset)
+        count = partitionSize - offset;
 
-    off_t absoluteOffset = partitionOffset + cursor;
-    if (vdi->lSeek(static_cast<uint32_t>(absoluteOffset), SEEK_SET_) != static_cast<uint32_t>(absoluteOffset))
+    if (readAheadIO)
     {
-        std::cerr << "Failed to set cursor in VDI" << "\n";
-        return -1;
+        std::lock_guard<std::mutex> lock(readAheadLock);
+        DropStaging(offset, count);
     }
 
-    ssize_t bytesWritten = vdi->Write(buf, count);
+    ssize_t bytesWritten = vdi->WriteAt(partitionOffset + offset, buf, count);
     if (bytesWritten < 0)
     {
         std::cerr << "Failed to write to VDI" << "\n";
         return -1;
     }
 
-    cursor += bytesWritten;
     return bytesWritten;
 }
 
@@ -127,7 +214,7 @@ ssize_t MBRPartition::lSeek(ssize_t offset, int whence)
         return cursor;
     }
 
-    if (newCursor > partitionSize)
+    if (newCursor < 0 || static_cast<uint64_t>(newCursor) > partitionSize)
     {
         std::cerr << "Cursor exceeded partition" << "\n";
         return cursor;
@@ -136,3 +223,127 @@ ssize_t MBRPartition::lSeek(ssize_t offset, int whence)
     cursor = newCursor;
     return cursor;
 }
+
+bool MBRPartition::EnableReadAhead(uint32_t minWindow, uint32_t maxWindow)
+{
+    if (readAheadIO)
+        return true;
+    if (minWindow == 0 || maxWindow < minWindow)
+    {
+        std::cerr << "Invalid read-ahead window " << minWindow << " to " << maxWindow << "\n";
+        return false;
+    }
+
+    readAheadIO = new VDIAsyncIO;
+    if (!readAheadIO->Start(vdi, 8, 1))
+    {
+        delete readAheadIO;
+        readAheadIO = nullptr;
+        return false;
+    }
+
+    this->minWindow = minWindow;
+    this->maxWindow = maxWindow;
+    window = 0;
+    streamEnd = ~0ull;
+    for (ReadAheadBuffer &buffer : staging)
+    {
+        buffer.data = new uint8_t[maxWindow];
+        buffer.offset = 0;
+        buffer.length = 0;
+    }
+    return true;
+}
+
+void MBRPartition::DisableReadAhead()
+{
+    if (!readAheadIO)
+        return;
+
+    for (ReadAheadBuffer &buffer : staging)
+    {
+        if (buffer.pending.valid())
+            buffer.pending.get();
+        delete[] buffer.data;
+        buffer.data = nullptr;
+        buffer.length = 0;
+    }
+    readAheadIO->Stop();
+    delete readAheadIO;
+    readAheadIO = nullptr;
+}
+
+// Caller holds readAheadLock
+bool MBRPartition::ReadFromStaging(uint64_t offset, void *buf, size_t count)
+{
+    for (ReadAheadBuffer &buffer : staging)
+    {
+        if (buffer.length == 0 || offset < buffer.offset || offset + count > buffer.offset + buffer.length)
+            continue;
+
+        if (buffer.pending.valid() && buffer.pending.get() != static_cast<ssize_t>(buffer.length))
+        {
+            buffer.length = 0;
+            return false;
+        }
+        memcpy(buf, buffer.data + (offset - buffer.offset), count);
+        return true;
+    }
+    return false;
+}
+
+// Caller holds readAheadLock. Keeps the buffer holding offset, and the one right
+// after it, staged: while the stream reads from one the other is being filled.
+void MBRPartition::Prefetch(uint64_t offset)
+{
+    ReadAheadBuffer *current = nullptr;
+    for (ReadAheadBuffer &buffer : staging)
+    {
+        if (buffer.length > 0 && offset >= buffer.offset && offset < buffer.offset + buffer.length)
+            current = &buffer;
+    }
+
+    if (!current)
+    {
+        // Reuse whichever buffer lies further behind the stream
+        ReadAheadBuffer &oldest = staging[0].offset <= staging[1].offset ? staging[0] : staging[1];
+        FillStaging(oldest, offset);
+        return;
+    }
+
+    ReadAheadBuffer &other = current == &staging[0] ? staging[1] : staging[0];
+    uint64_t next = current->offset + current->length;
+    if (other.length > 0 && other.offset == next)
+        return;
+    FillStaging(other, next);
+}
+
+void MBRPartition::FillStaging(ReadAheadBuffer &buffer, uint64_t offset)
+{
+    if (buffer.pending.valid())
+        buffer.pending.get();
+    buffer.length = 0;
+
+    if (offset >= partitionSize)
+        return;
+    uint64_t length = window;
+    if (length > partitionSize - offset)
+        length = partitionSize - offset;
+
+    buffer.offset = offset;
+    buffer.length = length;
+    buffer.pending = readAheadIO->ReadAsync(partitionOffset + offset, buffer.data, length);
+}
+
+// Caller holds readAheadLock
+void MBRPartition::DropStaging(uint64_t offset, uint64_t count)
+{
+    for (ReadAheadBuffer &buffer : staging)
+    {
+        if (buffer.length == 0 || offset >= buffer.offset + buffer.length || offset + count <= buffer.offset)
+            continue;
+        if (buffer.pending.valid())
+            buffer.pending.get();
+        buffer.length = 0;
+    }
+}
@@ -2,33 +2,69 @@
 #define OS_PROJECT_MBRPARTITION_H
 
 #include <cstdio>
+#include <future>
+#include <mutex>
 #include "../step-1/VDIFile.h"
+#include "../step-1/VDIAsyncIO.h"
+#include "PartitionMap.h"
 
-struct PartitionEntry
+// One of the two staging buffers read-ahead fills
+struct ReadAheadBuffer
 {
-    uint8_t status;
-    uint8_t firstCHS[3];
-    uint8_t partitionType;
-    uint8_t lastCHS[3];
-    uint32_t firstSector;
-    uint32_t totalSectors;
+    uint8_t *data;
+    uint64_t offset;                // Partition offset of data[0]
+    uint64_t length;                // 0 while the buffer holds nothing
+    std::future<ssize_t> pending;   // Valid while the read into data is in flight
 };
 
 class MBRPartition
 {
 private:
     off_t cursor;
+
+    // Read-ahead state, see EnableReadAhead
+    VDIAsyncIO *readAheadIO;
+    ReadAheadBuffer staging[2];
+    uint32_t minWindow;
+    uint32_t maxWindow;
+    uint32_t window;                // Bytes fetched ahead of the stream; 0 while access is random
+    uint64_t streamEnd;             // Where the next read has to start to count as sequential
+    std::mutex readAheadLock;
+    bool ReadFromStaging(uint64_t offset, void *buf, size_t count);
+    void Prefetch(uint64_t offset);
+    void FillStaging(ReadAheadBuffer &buffer, uint64_t offset);
+    void DropStaging(uint64_t offset, uint64_t count);
+    void DisableReadAhead();
+    bool Attach(VDIFile *image, uint64_t offset, uint64_t size);
 public:
-    VDIFile *vdi;
+    VDIFile *vdi;                   // Shared by every partition opened from the same image
     PartitionEntry partitionTable[4];
-    uint32_t partitionOffset;
-    uint32_t partitionSize;
+    uint64_t partitionOffset;
+    uint64_t partitionSize;
+
+    uint64_t readAheadHits;         // ReadAt calls served from the staging buffers
 
     bool Open(char *fn, int part);
+    // Opens a partition of an image that is already open; the partition holds a reference to it
+    bool Open(VDIFile *image, int part);
+    // Opens another partition of sibling's image, reusing its handle and parsed table
+    bool Open(MBRPartition *sibling, int part);
+    // Opens partition index of a scanned map, which may be a GPT or logical partition
+    bool Open(PartitionMap *map, uint32_t index);
+    // Index of the first entry with the given type, or -1
+    int FindPartition(uint8_t partitionType);
     void Close();
+    // Detects sequential ReadAt calls and fetches the data after them in the
+    // background. The window starts at minWindow bytes, doubles while the stream
+    // continues up to maxWindow, and halves back to nothing on random access.
+    bool EnableReadAhead(uint32_t minWindow = 16 * 1024, uint32_t maxWindow = 256 * 1024);
     ssize_t Read(void *buf, size_t count);
     ssize_t Write(void *buf, size_t count);
+    ssize_t ReadAt(uint64_t offset, void *buf, size_t count);
+    ssize_t WriteAt(uint64_t offset, const void *buf, size_t count);
     ssize_t lSeek(ssize_t offset, int whence);
+    uint64_t Size() { return partitionSize; }
+    bool ReadAheadEnabled() { return readAheadIO != nullptr; }
 };
 
 #endif
@@ -1,4 +1,6 @@
 #include <iostream>
+#include <cstring>
+#include "BlockDevice.h"
 #include "MBRPartition.h"
 
 void DisplayBufferPage(uint8_t *buf, uint32_t count, uint32_t skip, uint64_t offset)
@@ -100,6 +102,190 @@ void displayPartitionEntry(const PartitionEntry &entry, int index)
     std::cout << "LBA sector count: " << entry.totalSectors << "\n\n";
 }
 
+void TestLargePartition(const char *filePath)
+{
+    // Sparse 12 GiB image with one partition starting at 5 GiB
+    VDIFile vdi;
+    if (!vdi.Create(const_cast<char *>(filePath), 12ull << 30))
+    {
+        std::cerr << "LargePartition: Create failed" << std::endl;
+        return;
+    }
+
+    uint8_t mbr[512] = {0};
+    PartitionEntry entry = {0, {0}, 0x83, {0}, static_cast<uint32_t>((5ull << 30) / 512), static_cast<uint32_t>((6ull << 30) / 512)};
+    memcpy(mbr + 446, &entry, sizeof(entry));
+    mbr[510] = 0x55;
+    mbr[511] = 0xAA;
+    vdi.WriteAt(0, mbr, sizeof(mbr));
+    vdi.Close();
+
+    MBRPartition part;
+    if (!part.Open(const_cast<char *>(filePath), 0))
+    {
+        std::cerr << "LargePartition: Open failed" << std::endl;
+        return;
+    }
+
+    const char message[] = "past 4 GiB";
+    char readBack[sizeof(message)] = {0};
+    uint64_t offset = part.partitionSize - sizeof(message);
+    part.WriteAt(offset, message, sizeof(message));
+    part.ReadAt(offset, readBack, sizeof(readBack));
+
+    uint8_t direct[sizeof(message)] = {0};
+    part.vdi->ReadAt(part.partitionOffset + offset, direct, sizeof(direct));
+
+    if (part.partitionOffset == 5ull << 30 && memcmp(message, readBack, sizeof(message)) == 0 &&
+        memcmp(message, direct, sizeof(message)) == 0)
+        std::cout << "LargePartition: Offset " << part.partitionOffset << " size " << part.partitionSize << " OK" << std::endl;
+    else
+        std::cerr << "LargePartition: Failed" << std::endl;
+    part.Close();
+}
+
+void TestReadAhead(char *filePath, int part, uint64_t length)
+{
+    MBRPartition plain, streamed;
+    if (!plain.Open(filePath, part) || !streamed.Open(filePath, part) || !streamed.EnableReadAhead())
+    {
+        std::cerr << "ReadAhead: Open failed" << std::endl;
+        return;
+    }
+
+    // Read the partition 1 KiB at a time, the way FetchBlock does
+    uint8_t expected[1024], actual[1024];
+    bool matched = true;
+    if (length > plain.partitionSize)
+        length = plain.partitionSize;
+    for (uint64_t offset = 0; matched && offset + sizeof(actual) <= length; offset += sizeof(actual))
+    {
+        plain.ReadAt(offset, expected, sizeof(expected));
+        matched = streamed.ReadAt(offset, actual, sizeof(actual)) == sizeof(actual) &&
+                  memcmp(expected, actual, sizeof(actual)) == 0;
+    }
+
+    if (matched)
+        std::cout << "ReadAhead: " << streamed.readAheadHits << " of " << length / 1024 << " reads served from staging" << std::endl;
+    else
+        std::cerr << "ReadAhead: Failed" << std::endl;
+    streamed.Close();
+    plain.Close();
+}
+
+void TestSharedPartitions(char *filePath)
+{
+    MBRPartition first;
+    if (!first.Open(filePath, 0))
+    {
+        std::cerr << "SharedPartitions: Open failed" << std::endl;
+        return;
+    }
+
+    // Every entry opened next to the first shares its image, and reads the
+    // same data as a partition opened on its own
+    bool matched = true;
+    int shared = 0;
+    for (int i = 0; matched && i < 4; i++)
+    {
+        if (first.partitionTable[i].totalSectors == 0)
+            continue;
+
+        MBRPartition sibling, separate;
+        if (!sibling.Open(&first, i) || !separate.Open(filePath, i))
+        {
+            matched = false;
+            break;
+        }
+
+        uint8_t expected[1024], actual[1024];
+        matched = sibling.vdi == first.vdi && separate.vdi != first.vdi &&
+                  sibling.ReadAt(0, actual, sizeof(actual)) == separate.ReadAt(0, expected, sizeof(expected)) &&
+                  memcmp(expected, actual, sizeof(actual)) == 0;
+        shared++;
+        sibling.Close();
+        separate.Close();
+    }
+
+    if (matched)
+        std::cout << "SharedPartitions: " << shared << " partitions opened on one image" << std::endl;
+    else
+        std::cerr << "SharedPartitions: Failed" << std::endl;
+    first.Close();
+}
+
+void TestPartitionMap(char *filePath)
+{
+    PartitionMap map;
+    if (!map.Open(filePath))
+    {
+        std::cerr << "PartitionMap: Open failed" << std::endl;
+        return;
+    }
+
+    std::cout << "PartitionMap: " << (map.gpt ? "GPT" : "MBR") << " disk with " << map.GetCount() << " partitions\n";
+    for (uint32_t i = 0; i < map.GetCount(); i++)
+    {
+        const PartitionInfo &info = map.Get(i);
+        std::cout << "  #" << info.number << " type 0x" << std::hex << static_cast<int>(info.type) << std::dec
+                  << " at " << info.offset << ", " << info.size << " bytes\n";
+    }
+
+    // The Linux partition opened from the map reads like one opened by slot
+    int linuxIndex = map.Find(0x83);
+    MBRPartition part;
+    if (linuxIndex >= 0 && part.Open(&map, linuxIndex) && part.vdi == map.vdi)
+        std::cout << "PartitionMap: Linux partition #" << map.Get(linuxIndex).number << " at " << part.partitionOffset << std::endl;
+    else
+        std::cerr << "PartitionMap: No Linux partition" << std::endl;
+    part.Close();
+    map.Close();
+}
+
+void TestBlockDeviceStack(char *filePath, int part)
+{
+    MBRPartition reference;
+    if (!reference.Open(filePath, part))
+    {
+        std::cerr << "BlockDeviceStack: Open failed" << std::endl;
+        return;
+    }
+
+    // The same partition as a compile-time stack, as a window folded out of a
+    // window over the whole disk, and behind the virtual adapter
+    VDIDevice image;
+    PartitionWindow<VDIDevice> disk, window;
+    CachedDevice<PartitionWindow<VDIDevice>> cached;
+    BlockDeviceAdapter<PartitionWindow<VDIDevice>> adapter;
+    image.Open(reference.vdi);
+    disk.Open(&image, 0, image.Size());
+    window.Open(&disk, reference.partitionOffset, reference.partitionSize);
+    cached.Open(&window);
+    adapter.device.Open(&image, reference.partitionOffset, reference.partitionSize);
+    AnyBlockDevice *runtime = &adapter;
+
+    uint8_t expected[1024], actual[1024];
+    bool matched = window.Start() == reference.partitionOffset;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (uint64_t offset = 0; matched && offset < 64 * 1024; offset += sizeof(actual))
+        {
+            reference.ReadAt(offset, expected, sizeof(expected));
+            matched = window.ReadAt(offset, actual, sizeof(actual)) == sizeof(actual) && memcmp(expected, actual, sizeof(actual)) == 0 &&
+                      cached.ReadAt(offset, actual, sizeof(actual)) == sizeof(actual) && memcmp(expected, actual, sizeof(actual)) == 0 &&
+                      runtime->ReadAt(offset, actual, sizeof(actual)) == sizeof(actual) && memcmp(expected, actual, sizeof(actual)) == 0;
+        }
+    }
+
+    if (matched && window.ReadAt(window.Size(), actual, sizeof(actual)) == 0)
+        std::cout << "BlockDeviceStack: Matched, cache " << cached.hits << " hits " << cached.misses << " misses" << std::endl;
+    else
+        std::cerr << "BlockDeviceStack: Failed" << std::endl;
+    cached.Close();
+    image.Close();
+    reference.Close();
+}
+
 int main()
 {
     char filename[] = "c:/dev/cpp/OS-project/vdi-files/good-dynamic-1k.vdi";
@@ -120,5 +306,11 @@ int main()
     }
 
     mbrPart.Close();
+
+//    TestLargePartition("c:/dev/cpp/OS-project/vdi-files/large-partition.vdi");
+//    TestReadAhead(filename, partitionIndex, 4 * 1024 * 1024);
+//    TestSharedPartitions(filename);
+//    TestPartitionMap(filename);
+//    TestBlockDeviceStack(filename, partitionIndex);
     return 0;
 }
@@ -0,0 +1,254 @@
+#include <cstring>
+#include <iostream>
+#include "PartitionMap.h"
+
+static bool IsExtended(uint8_t type)
+{
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+static const uint32_t *BuildCrcTable()
+{
+    static uint32_t table[256];
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        table[i] = crc;
+    }
+    return table;
+}
+
+// CRC-32 as used by the GPT header and entry array
+static uint32_t Crc32(const uint8_t *data, size_t length)
+{
+    static const uint32_t *table = BuildCrcTable();
+
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+bool PartitionMap::Open(char *fn)
+{
+    vdi = nullptr;
+
+    VDIFile *image = new VDIFile;
+    if (!image->Open(fn))
+    {
+        delete image;
+        return false;
+    }
+
+    // The map takes its own reference; drop the one Open left
+    bool opened = Open(image);
+    image->Release();
+    return opened;
+}
+
+bool PartitionMap::Open(VDIFile *image)
+{
+    vdi = image;
+    vdi->Retain();
+    partitions.clear();
+    byType.clear();
+    byGuid.clear();
+
+    if (!Scan())
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void PartitionMap::Close()
+{
+    if (vdi)
+    {
+        vdi->Release();
+        vdi = nullptr;
+    }
+}
+
+bool PartitionMap::Scan()
+{
+    uint8_t mbr[512];
+    if (vdi->ReadAt(0, mbr, 512) != 512)
+    {
+        std::cerr << "Could not read the partition table" << "\n";
+        return false;
+    }
+
+    gpt = false;
+    for (int i = 0; i < 4; i++)
+    {
+        memcpy(&primary[i], mbr + 446 + i * 16, sizeof(PartitionEntry));
+        if (primary[i].partitionType == 0xEE)
+            gpt = true;
+    }
+    if (gpt)
+        return ScanGPT();
+
+    // Primaries keep their slot numbers; logicals are numbered after them
+    int extended = -1;
+    for (int i = 0; i < 4; i++)
+    {
+        if (primary[i].partitionType == 0 || primary[i].totalSectors == 0)
+            continue;
+        if (IsExtended(primary[i].partitionType))
+        {
+            if (extended < 0)
+                extended = i;
+            continue;
+        }
+        Add(primary[i].firstSector, primary[i].totalSectors, primary[i].partitionType, nullptr, i + 1);
+    }
+
+    // A broken chain keeps the logical partitions found before the break
+    if (extended >= 0)
+        ScanExtended(primary[extended].firstSector);
+    return true;
+}
+
+// Follows the chain of extended boot records. Each one describes a logical
+// partition relative to itself and links to the next relative to the container.
+bool PartitionMap::ScanExtended(uint32_t firstSector)
+{
+    uint64_t ebr = firstSector;
+    uint32_t number = 5;
+
+    for (uint32_t i = 0; i < MBR_MAX_LOGICAL_PARTITIONS; i++)
+    {
+        uint8_t sector[512];
+        if (vdi->ReadAt(ebr * 512, sector, 512) != 512 || sector[510] != 0x55 || sector[511] != 0xAA)
+        {
+            std::cerr << "Invalid extended boot record at sector " << ebr << "\n";
+            return false;
+        }
+
+        PartitionEntry logical, next;
+        memcpy(&logical, sector + 446, sizeof(PartitionEntry));
+        memcpy(&next, sector + 462, sizeof(PartitionEntry));
+
+        if (logical.partitionType != 0 && logical.totalSectors != 0)
+            Add(ebr + logical.firstSector, logical.totalSectors, logical.partitionType, nullptr, number++);
+
+        if (!IsExtended(next.partitionType) || next.firstSector == 0)
+            return true;
+        ebr = static_cast<uint64_t>(firstSector) + next.firstSector;
+    }
+
+    std::cerr << "More than " << MBR_MAX_LOGICAL_PARTITIONS << " logical partitions" << "\n";
+    return false;
+}
+
+bool PartitionMap::ReadGPTHeader(uint64_t lba, uint8_t *gptHeader)
+{
+    if (vdi->ReadAt(lba * 512, gptHeader, 512) != 512 || memcmp(gptHeader, "EFI PART", 8) != 0)
+        return false;
+
+    uint32_t headerSize, headerCrc;
+    uint64_t myLBA;
+    memcpy(&headerSize, gptHeader + 12, sizeof(headerSize));
+    memcpy(&headerCrc, gptHeader + 16, sizeof(headerCrc));
+    memcpy(&myLBA, gptHeader + 24, sizeof(myLBA));
+    if (headerSize < 92 || headerSize > 512 || myLBA != lba)
+        return false;
+
+    // The checksum covers the header with its own field zeroed
+    uint8_t copy[512];
+    memcpy(copy, gptHeader, headerSize);
+    memset(copy + 16, 0, sizeof(headerCrc));
+    return Crc32(copy, headerSize) == headerCrc;
+}
+
+bool PartitionMap::ScanGPT()
+{
+    // A damaged primary header falls back to the backup in the last sector
+    uint8_t gptHeader[512];
+    if (!ReadGPTHeader(1, gptHeader) && !ReadGPTHeader(vdi->header->diskSize / 512 - 1, gptHeader))
+    {
+        std::cerr << "No valid GPT header" << "\n";
+        return false;
+    }
+
+    uint64_t entriesLBA;
+    uint32_t numEntries, entrySize, entriesCrc;
+    memcpy(&entriesLBA, gptHeader + 72, sizeof(entriesLBA));
+    memcpy(&numEntries, gptHeader + 80, sizeof(numEntries));
+    memcpy(&entrySize, gptHeader + 84, sizeof(entrySize));
+    memcpy(&entriesCrc, gptHeader + 88, sizeof(entriesCrc));
+    if (entrySize < 128 || entrySize % 8 != 0 || numEntries > 16384)
+    {
+        std::cerr << "Invalid GPT entry array of " << numEntries << " entries of " << entrySize << " bytes" << "\n";
+        return false;
+    }
+
+    // The whole entry array is fetched with one read
+    std::vector<uint8_t> entries(static_cast<size_t>(numEntries) * entrySize);
+    if (vdi->ReadAt(entriesLBA * 512, entries.data(), entries.size()) != static_cast<ssize_t>(entries.size()) ||
+        Crc32(entries.data(), entries.size()) != entriesCrc)
+    {
+        std::cerr << "Could not read the GPT entry array" << "\n";
+        return false;
+    }
+
+    static const uint8_t unused[16] = {0};
+    for (uint32_t i = 0; i < numEntries; i++)
+    {
+        const uint8_t *entry = entries.data() + static_cast<size_t>(i) * entrySize;
+        if (memcmp(entry, unused, sizeof(unused)) == 0)
+            continue;
+
+        uint64_t firstLBA, lastLBA;
+        memcpy(&firstLBA, entry + 32, sizeof(firstLBA));
+        memcpy(&lastLBA, entry + 40, sizeof(lastLBA));
+        if (lastLBA < firstLBA)
+            continue;
+
+        uint8_t type = memcmp(entry, GPT_LINUX_DATA_GUID, sizeof(GPT_LINUX_DATA_GUID)) == 0 ? 0x83 : 0xEE;
+        Add(firstLBA, lastLBA - firstLBA + 1, type, entry, i + 1);
+    }
+    return true;
+}
+
+void PartitionMap::Add(uint64_t firstSector, uint64_t totalSectors, uint8_t type, const uint8_t *typeGuid, uint32_t number)
+{
+    if ((firstSector + totalSectors) * 512 > vdi->header->diskSize)
+    {
+        std::cerr << "Partition " << number << " extends past the end of the disk" << "\n";
+        return;
+    }
+
+    PartitionInfo info = {firstSector * 512, totalSectors * 512, type, {0}, number};
+    if (typeGuid)
+        memcpy(info.typeGuid, typeGuid, sizeof(info.typeGuid));
+
+    uint32_t index = partitions.size();
+    partitions.push_back(info);
+    byType[type].push_back(index);
+    if (typeGuid)
+        byGuid[std::string(reinterpret_cast<const char*>(typeGuid), sizeof(info.typeGuid))].push_back(index);
+}
+
+int PartitionMap::Find(uint8_t type)
+{
+    auto it = byType.find(type);
+    return it == byType.end() ? -1 : it->second.front();
+}
+
+int PartitionMap::Find(const uint8_t typeGuid[16])
+{
+    auto it = byGuid.find(std::string(reinterpret_cast<const char*>(typeGuid), 16));
+    return it == byGuid.end() ? -1 : it->second.front();
+}
+
+const std::vector<uint32_t> &PartitionMap::FindAll(uint8_t type)
+{
+    static const std::vector<uint32_t> none;
+    auto it = byType.find(type);
+    return it == byType.end() ? none : it->second;
+}
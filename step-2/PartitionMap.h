@@ -0,0 +1,69 @@
+#ifndef OS_PROJECT_PARTITIONMAP_H
+#define OS_PROJECT_PARTITIONMAP_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../step-1/VDIFile.h"
+
+struct PartitionEntry
+{
+    uint8_t status;
+    uint8_t firstCHS[3];
+    uint8_t partitionType;
+    uint8_t lastCHS[3];
+    uint32_t firstSector;
+    uint32_t totalSectors;
+};
+
+// Linux filesystem data partition type, 0FC63DAF-8483-4772-8E79-3D69D8477DE4, in on-disk byte order
+const uint8_t GPT_LINUX_DATA_GUID[16] = {0xAF, 0x3D, 0xC6, 0x0F, 0x83, 0x84, 0x72, 0x47,
+                                         0x8E, 0x79, 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4};
+
+// Extended partitions are followed for at most this many logical partitions
+const uint32_t MBR_MAX_LOGICAL_PARTITIONS = 128;
+
+struct PartitionInfo
+{
+    uint64_t offset;            // In bytes from the start of the disk
+    uint64_t size;
+    uint8_t type;               // MBR type; GPT entries use 0x83 for Linux data and 0xEE otherwise
+    uint8_t typeGuid[16];       // GPT partition type, all zero for MBR entries
+    uint32_t number;            // Linux numbering: primaries 1-4 and logicals from 5, or the GPT entry + 1
+};
+
+// Every partition of an image, from the MBR primaries, the logical partitions
+// of extended containers and the GPT, found by one scan when the map is opened.
+// Lookups by type or type GUID are hash lookups and never touch the disk.
+class PartitionMap
+{
+private:
+    std::vector<PartitionInfo> partitions;
+    std::unordered_map<uint8_t, std::vector<uint32_t>> byType;
+    std::unordered_map<std::string, std::vector<uint32_t>> byGuid;
+
+    bool Scan();
+    bool ScanExtended(uint32_t firstSector);
+    bool ScanGPT();
+    bool ReadGPTHeader(uint64_t lba, uint8_t *gptHeader);
+    void Add(uint64_t firstSector, uint64_t totalSectors, uint8_t type, const uint8_t *typeGuid, uint32_t number);
+public:
+    VDIFile *vdi;               // The map holds a reference while open
+    PartitionEntry primary[4];  // The four entries of the MBR; the protective entry on GPT disks
+    bool gpt;
+
+    bool Open(char *fn);
+    bool Open(VDIFile *image);
+    void Close();
+
+    uint32_t GetCount() { return partitions.size(); }
+    const PartitionInfo &Get(uint32_t index) { return partitions[index]; }
+    // Index of the first partition with the given MBR type or GPT type GUID, or -1
+    int Find(uint8_t type);
+    int Find(const uint8_t typeGuid[16]);
+    // Indexes of every partition with the given MBR type, in disk order
+    const std::vector<uint32_t> &FindAll(uint8_t type);
+};
+
+#endif
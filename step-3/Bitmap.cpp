@@ -0,0 +1,227 @@
+#include <cstring>
+#include "Bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_X86 1
+#endif
+
+// Word index of a bitmap as a little-endian 64-bit value; the bytes of a last
+// word that reach past the range are read as zero
+static inline uint64_t LoadWord(const uint8_t *bitmap, uint32_t word, uint32_t last)
+{
+    size_t byte = static_cast<size_t>(word) * 8;
+    size_t end = (static_cast<size_t>(last) + 7) / 8;
+    uint64_t value = 0;
+    memcpy(&value, bitmap + byte, end - byte < 8 ? end - byte : 8);
+    return value;
+}
+
+// Bits below bit % 64 of a word cleared, or those from it on
+static inline uint64_t HeadMask(uint32_t bit) { return ~0ull << (bit % 64); }
+static inline uint64_t TailMask(uint32_t bit) { return bit % 64 == 0 ? ~0ull : (1ull << (bit % 64)) - 1; }
+
+// First word of [word, endWord) that differs from fill, or endWord
+static uint32_t SkipFilledScalar(const uint8_t *bitmap, uint32_t word, uint32_t endWord, uint64_t fill)
+{
+    for (; word < endWord; word++)
+    {
+        uint64_t value;
+        memcpy(&value, bitmap + static_cast<size_t>(word) * 8, sizeof(value));
+        if (value != fill)
+            break;
+    }
+    return word;
+}
+
+// Set bits of the whole words [word, endWord)
+static uint32_t CountWordsScalar(const uint8_t *bitmap, uint32_t word, uint32_t endWord)
+{
+    uint32_t count = 0;
+    for (; word < endWord; word++)
+    {
+        uint64_t value;
+        memcpy(&value, bitmap + static_cast<size_t>(word) * 8, sizeof(value));
+        count += __builtin_popcountll(value);
+    }
+    return count;
+}
+
+#ifdef BITMAP_X86
+__attribute__((target("avx2")))
+static uint32_t SkipFilledAVX2(const uint8_t *bitmap, uint32_t word, uint32_t endWord, uint64_t fill)
+{
+    __m256i pattern = _mm256_set1_epi64x(static_cast<long long>(fill));
+    for (; word + 8 <= endWord; word += 8)
+    {
+        const uint8_t *p = bitmap + static_cast<size_t>(word) * 8;
+        __m256i a = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), pattern);
+        __m256i b = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32)), pattern);
+        __m256i diff = _mm256_or_si256(a, b);
+        if (!_mm256_testz_si256(diff, diff))
+            break;
+    }
+    // The block that differs is pinned down a word at a time
+    return SkipFilledScalar(bitmap, word, endWord, fill);
+}
+
+__attribute__((target("popcnt")))
+static uint32_t CountWordsPopcnt(const uint8_t *bitmap, uint32_t word, uint32_t endWord)
+{
+    uint32_t count = 0;
+    for (; word < endWord; word++)
+    {
+        uint64_t value;
+        memcpy(&value, bitmap + static_cast<size_t>(word) * 8, sizeof(value));
+        count += __builtin_popcountll(value);
+    }
+    return count;
+}
+#endif
+
+typedef uint32_t (*SkipKernel)(const uint8_t *, uint32_t, uint32_t, uint64_t);
+typedef uint32_t (*CountKernel)(const uint8_t *, uint32_t, uint32_t);
+
+static SkipKernel SelectSkipKernel()
+{
+#ifdef BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SkipFilledAVX2;
+#endif
+    return SkipFilledScalar;
+}
+
+static CountKernel SelectCountKernel()
+{
+#ifdef BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt"))
+        return CountWordsPopcnt;
+#endif
+    return CountWordsScalar;
+}
+
+static uint32_t SkipFilled(const uint8_t *bitmap, uint32_t word, uint32_t endWord, uint64_t fill)
+{
+    static const SkipKernel kernel = SelectSkipKernel();
+    return kernel(bitmap, word, endWord, fill);
+}
+
+static uint32_t CountWords(const uint8_t *bitmap, uint32_t word, uint32_t endWord)
+{
+    static const CountKernel kernel = SelectCountKernel();
+    return kernel(bitmap, word, endWord);
+}
+
+static uint32_t FindBit(const uint8_t *bitmap, uint32_t first, uint32_t last, bool value)
+{
+    if (first >= last)
+        return last;
+
+    // Words are flipped when looking for a clear bit, so the bits sought are ones
+    uint64_t flip = value ? 0 : ~0ull;
+    uint32_t word = first / 64;
+    uint64_t bits = (LoadWord(bitmap, word, last) ^ flip) & HeadMask(first);
+
+    while (bits == 0)
+    {
+        word = SkipFilled(bitmap, word + 1, last / 64, flip);
+        if (static_cast<uint64_t>(word) * 64 >= last)
+            return last;
+        bits = LoadWord(bitmap, word, last) ^ flip;
+    }
+
+    uint32_t bit = word * 64 + __builtin_ctzll(bits);
+    return bit < last ? bit : last;
+}
+
+uint32_t BitmapFindZero(const uint8_t *bitmap, uint32_t first, uint32_t last)
+{
+    return FindBit(bitmap, first, last, false);
+}
+
+uint32_t BitmapFindOne(const uint8_t *bitmap, uint32_t first, uint32_t last)
+{
+    return FindBit(bitmap, first, last, true);
+}
+
+uint32_t BitmapFindZeroRun(const uint8_t *bitmap, uint32_t first, uint32_t last, uint32_t length)
+{
+    uint32_t start = BitmapFindZero(bitmap, first, last);
+    while (start < last && last - start >= length)
+    {
+        // Only the first length bits past a clear one need looking at
+        uint32_t end = BitmapFindOne(bitmap, start, start + length);
+        if (end == start + length)
+            return start;
+        start = BitmapFindZero(bitmap, end, last);
+    }
+    return last;
+}
+
+uint32_t BitmapLongestZeroRun(const uint8_t *bitmap, uint32_t first, uint32_t last, uint32_t &start)
+{
+    uint32_t longest = 0;
+    start = last;
+
+    uint32_t runStart = BitmapFindZero(bitmap, first, last);
+    while (runStart < last && last - runStart > longest)
+    {
+        uint32_t runEnd = BitmapFindOne(bitmap, runStart, last);
+        if (runEnd - runStart > longest)
+        {
+            longest = runEnd - runStart;
+            start = runStart;
+        }
+        runStart = BitmapFindZero(bitmap, runEnd, last);
+    }
+    return longest;
+}
+
+uint32_t BitmapCount(const uint8_t *bitmap, uint32_t first, uint32_t last)
+{
+    if (first >= last)
+        return 0;
+
+    uint32_t firstWord = first / 64;
+    uint32_t lastWord = (last - 1) / 64;
+    uint64_t head = LoadWord(bitmap, firstWord, last) & HeadMask(first);
+    if (firstWord == lastWord)
+        return __builtin_popcountll(head & TailMask(last));
+
+    uint64_t tail = LoadWord(bitmap, lastWord, last) & TailMask(last);
+    return __builtin_popcountll(head) + CountWords(bitmap, firstWord + 1, lastWord) + __builtin_popcountll(tail);
+}
+
+bool BitmapTest(const uint8_t *bitmap, uint32_t bit)
+{
+    return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+static void Fill(uint8_t *bitmap, uint32_t first, uint32_t count, bool value)
+{
+    uint32_t bit = first;
+    uint32_t end = first + count;
+
+    // Partial bytes at either end go a bit at a time, whole bytes in between with memset
+    for (; bit < end && bit % 8 != 0; bit++)
+        bitmap[bit / 8] = value ? bitmap[bit / 8] | (1 << (bit % 8)) : bitmap[bit / 8] & ~(1 << (bit % 8));
+    if (end - bit >= 8)
+    {
+        memset(bitmap + bit / 8, value ? 0xFF : 0, (end - bit) / 8);
+        bit += (end - bit) / 8 * 8;
+    }
+    for (; bit < end; bit++)
+        bitmap[bit / 8] = value ? bitmap[bit / 8] | (1 << (bit % 8)) : bitmap[bit / 8] & ~(1 << (bit % 8));
+}
+
+void BitmapSet(uint8_t *bitmap, uint32_t first, uint32_t count)
+{
+    Fill(bitmap, first, count, true);
+}
+
+void BitmapClear(uint8_t *bitmap, uint32_t first, uint32_t count)
+{
+    Fill(bitmap, first, count, false);
+}
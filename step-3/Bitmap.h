@@ -0,0 +1,26 @@
+#ifndef OS_PROJECT_BITMAP_H
+#define OS_PROJECT_BITMAP_H
+
+#include <cstdint>
+
+// Scans of ext2 block and inode bitmaps, where bit i is bit i % 8 of byte i / 8.
+// Ranges are [first, last) in bits, and nothing past byte (last + 7) / 8 is
+// touched. Searches go a 64-bit word at a time with ctz; long runs of full or
+// empty words are skipped with AVX2 when the CPU has it.
+
+// Index of the first clear bit in the range, or last if there is none
+uint32_t BitmapFindZero(const uint8_t *bitmap, uint32_t first, uint32_t last);
+// Index of the first set bit in the range, or last if there is none
+uint32_t BitmapFindOne(const uint8_t *bitmap, uint32_t first, uint32_t last);
+// Start of the first run of at least length clear bits in the range, or last
+uint32_t BitmapFindZeroRun(const uint8_t *bitmap, uint32_t first, uint32_t last, uint32_t length);
+// Length of the longest run of clear bits in the range, and where it starts
+uint32_t BitmapLongestZeroRun(const uint8_t *bitmap, uint32_t first, uint32_t last, uint32_t &start);
+// Number of set bits in the range
+uint32_t BitmapCount(const uint8_t *bitmap, uint32_t first, uint32_t last);
+
+bool BitmapTest(const uint8_t *bitmap, uint32_t bit);
+void BitmapSet(uint8_t *bitmap, uint32_t first, uint32_t count);
+void BitmapClear(uint8_t *bitmap, uint32_t first, uint32_t count);
+
+#endif
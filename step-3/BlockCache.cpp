@@ -0,0 +1,193 @@
+#include <cstring>
+#include <iostream>
+#include "BlockCache.h"
+
+bool BlockCache::Init(uint32_t blockSize, uint32_t capacity, uint32_t shards, BlockCachePolicy policy,
+                      BlockReader reader, BlockWriter writer)
+{
+    if (blockSize == 0 || shards == 0 || capacity < shards)
+    {
+        std::cerr << "Invalid block cache of " << capacity << " blocks in " << shards << " shards" << "\n";
+        return false;
+    }
+
+    this->blockSize = blockSize;
+    this->policy = policy;
+    this->reader = reader;
+    this->writer = writer;
+    shardCount = shards;
+    this->shards = new Shard[shards];
+
+    uint32_t slotsPerShard = (capacity + shards - 1) / shards;
+    for (uint32_t i = 0; i < shards; i++)
+    {
+        Shard &shard = this->shards[i];
+        shard.slots.assign(slotsPerShard, {0, false, false, false});
+        shard.index.reserve(slotsPerShard);
+        shard.data = new uint8_t[static_cast<size_t>(slotsPerShard) * blockSize];
+        shard.hand = 0;
+        shard.stats = {0, 0, 0, 0};
+    }
+    return true;
+}
+
+bool BlockCache::Destroy()
+{
+    bool flushed = Flush();
+    for (uint32_t i = 0; i < shardCount; i++)
+        delete[] shards[i].data;
+    delete[] shards;
+    shards = nullptr;
+    shardCount = 0;
+    return flushed;
+}
+
+// Frees a slot of the shard with the CLOCK policy: the hand skips, and clears,
+// entries used since it last passed. A dirty victim is written back first.
+// Caller holds shard.lock.
+bool BlockCache::Evict(Shard &shard, uint32_t &slot)
+{
+    uint32_t size = shard.slots.size();
+    for (;;)
+    {
+        slot = shard.hand;
+        shard.hand = (shard.hand + 1) % size;
+
+        Entry &entry = shard.slots[slot];
+        if (!entry.valid)
+            return true;
+        if (entry.referenced)
+        {
+            entry.referenced = false;
+            continue;
+        }
+
+        if (entry.dirty)
+        {
+            if (!writer(entry.blockNum, SlotData(shard, slot)))
+                return false;
+            shard.stats.writeBacks++;
+        }
+        shard.index.erase(entry.blockNum);
+        entry.valid = false;
+        entry.dirty = false;
+        shard.stats.evictions++;
+        return true;
+    }
+}
+
+bool BlockCache::Read(uint32_t blockNum, void *buf)
+{
+    Shard &shard = ShardOf(blockNum);
+    std::lock_guard<std::mutex> lock(shard.lock);
+
+    auto it = shard.index.find(blockNum);
+    if (it != shard.index.end())
+    {
+        shard.stats.hits++;
+        shard.slots[it->second].referenced = true;
+        memcpy(buf, SlotData(shard, it->second), blockSize);
+        return true;
+    }
+
+    shard.stats.misses++;
+    uint32_t slot;
+    if (!Evict(shard, slot))
+        return reader(blockNum, buf);
+
+    uint8_t *data = SlotData(shard, slot);
+    if (!reader(blockNum, data))
+        return false;
+
+    shard.slots[slot] = {blockNum, true, false, true};
+    shard.index[blockNum] = slot;
+    memcpy(buf, data, blockSize);
+    return true;
+}
+
+bool BlockCache::Write(uint32_t blockNum, const void *buf)
+{
+    Shard &shard = ShardOf(blockNum);
+    std::lock_guard<std::mutex> lock(shard.lock);
+
+    auto it = shard.index.find(blockNum);
+    if (policy == BLOCK_CACHE_WRITE_THROUGH)
+    {
+        // Not allocated on a miss: a block that is only written stays out of the cache
+        if (!writer(blockNum, buf))
+            return false;
+        if (it != shard.index.end())
+        {
+            shard.slots[it->second].referenced = true;
+            memcpy(SlotData(shard, it->second), buf, blockSize);
+        }
+        return true;
+    }
+
+    uint32_t slot;
+    if (it != shard.index.end())
+        slot = it->second;
+    else if (!Evict(shard, slot))
+        return writer(blockNum, buf);
+
+    memcpy(SlotData(shard, slot), buf, blockSize);
+    shard.slots[slot] = {blockNum, true, true, true};
+    shard.index[blockNum] = slot;
+    return true;
+}
+
+void BlockCache::Overlay(uint32_t firstBlock, uint32_t count, void *buf)
+{
+    if (policy == BLOCK_CACHE_WRITE_THROUGH)
+        return;
+
+    uint8_t *out = reinterpret_cast<uint8_t*>(buf);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        Shard &shard = ShardOf(firstBlock + i);
+        std::lock_guard<std::mutex> lock(shard.lock);
+
+        auto it = shard.index.find(firstBlock + i);
+        if (it != shard.index.end() && shard.slots[it->second].dirty)
+            memcpy(out + static_cast<size_t>(i) * blockSize, SlotData(shard, it->second), blockSize);
+    }
+}
+
+bool BlockCache::Flush()
+{
+    bool flushed = true;
+    for (uint32_t i = 0; i < shardCount; i++)
+    {
+        Shard &shard = shards[i];
+        std::lock_guard<std::mutex> lock(shard.lock);
+
+        for (uint32_t slot = 0; slot < shard.slots.size(); slot++)
+        {
+            Entry &entry = shard.slots[slot];
+            if (!entry.valid || !entry.dirty)
+                continue;
+            if (!writer(entry.blockNum, SlotData(shard, slot)))
+            {
+                flushed = false;
+                continue;
+            }
+            entry.dirty = false;
+            shard.stats.writeBacks++;
+        }
+    }
+    return flushed;
+}
+
+BlockCacheStats BlockCache::GetStats()
+{
+    BlockCacheStats total = {0, 0, 0, 0};
+    for (uint32_t i = 0; i < shardCount; i++)
+    {
+        std::lock_guard<std::mutex> lock(shards[i].lock);
+        total.hits += shards[i].stats.hits;
+        total.misses += shards[i].stats.misses;
+        total.evictions += shards[i].stats.evictions;
+        total.writeBacks += shards[i].stats.writeBacks;
+    }
+    return total;
+}
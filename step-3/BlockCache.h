@@ -0,0 +1,81 @@
+#ifndef OS_PROJECT_BLOCKCACHE_H
+#define OS_PROJECT_BLOCKCACHE_H
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Moves one filesystem block between the cache and the device; false on failure
+typedef std::function<bool(uint32_t blockNum, void *buf)> BlockReader;
+typedef std::function<bool(uint32_t blockNum, const void *buf)> BlockWriter;
+
+enum BlockCachePolicy
+{
+    BLOCK_CACHE_WRITE_THROUGH,      // Writes reach the device before Write returns
+    BLOCK_CACHE_WRITE_BACK          // Writes stay in the cache until evicted or flushed
+};
+
+struct BlockCacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writeBacks;            // Dirty blocks written by eviction or Flush
+};
+
+// Block cache keyed by block number. Blocks are spread over shards by number,
+// each with its own lock, index and CLOCK replacement, so threads working on
+// different blocks rarely contend.
+class BlockCache
+{
+private:
+    struct Entry
+    {
+        uint32_t blockNum;
+        bool valid;
+        bool dirty;
+        bool referenced;            // Set on use, cleared as the CLOCK hand passes
+    };
+
+    struct Shard
+    {
+        std::mutex lock;
+        std::unordered_map<uint32_t, uint32_t> index;   // Block number to slot
+        std::vector<Entry> slots;
+        uint8_t *data;
+        uint32_t hand;
+        BlockCacheStats stats;
+    };
+
+    Shard *shards;
+    uint32_t shardCount;
+    uint32_t blockSize;
+    BlockCachePolicy policy;
+    BlockReader reader;
+    BlockWriter writer;
+
+    Shard &ShardOf(uint32_t blockNum) { return shards[blockNum % shardCount]; }
+    uint8_t *SlotData(Shard &shard, uint32_t slot) { return shard.data + static_cast<size_t>(slot) * blockSize; }
+    bool Evict(Shard &shard, uint32_t &slot);
+public:
+    // capacity is in blocks and is split evenly between the shards
+    bool Init(uint32_t blockSize, uint32_t capacity, uint32_t shards, BlockCachePolicy policy,
+              BlockReader reader, BlockWriter writer);
+    // Writes back dirty blocks and frees the cache
+    bool Destroy();
+
+    bool Read(uint32_t blockNum, void *buf);
+    bool Write(uint32_t blockNum, const void *buf);
+    // Copies dirty cached blocks of [firstBlock, firstBlock + count) over buf,
+    // for callers that read the range from the device directly
+    void Overlay(uint32_t firstBlock, uint32_t count, void *buf);
+    // Writes every dirty block to the device
+    bool Flush();
+
+    BlockCachePolicy GetPolicy() { return policy; }
+    BlockCacheStats GetStats();
+};
+
+#endif
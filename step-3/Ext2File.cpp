@@ -1,70 +1,120 @@
+#include <cstring>
 #include <iostream>
 #include "Ext2File.h"
+#include "Bitmap.h"
 
 #define EXT2_SUPERBLOCK_OFFSET 1024
 #define EXT2_SUPERBLOCK_SIZE sizeof(SuperBlock)
 #define EXT2_SUPER_MAGIC 0xEF53
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
 
 bool Ext2File::Open(char *fn)
 {
-    mbrPart = new MBRPartition;
-    if (!mbrPart->Open(fn, 0))
-    {
-        delete mbrPart;
-        mbrPart = nullptr;
+    asyncIO = nullptr;
+    cache = nullptr;
+    mbrPart = nullptr;
+    superblock = nullptr;
+    groupDesc = nullptr;
+    groupLocks = nullptr;
+
+    // The image is opened and scanned once; the ext2 partition is then opened on the same handle
+    PartitionMap map;
+    if (!map.Open(fn))
         return false;
-    }
-
-    int partIndex = -1;
-    for (int i = 0; i < 4; ++i)
-    {
-        if (mbrPart->partitionTable[i].partitionType == 0x83)
-        {
-            partIndex = i;
-            break;
-        }
-    }
 
+    int partIndex = map.Find(0x83);
     if (partIndex < 0)
     {
         std::cerr << "No ext2 partition of type 0x83 found" << "\n";
-        mbrPart->Close();
-        delete mbrPart;
-        mbrPart = nullptr;
+        map.Close();
         return false;
     }
 
-    mbrPart->Close();
-    if (!mbrPart->Open(fn, partIndex))
+    bool opened = Open(&map, partIndex);
+    map.Close();
+    return opened;
+}
+
+bool Ext2File::Open(PartitionMap *map, uint32_t index)
+{
+    asyncIO = nullptr;
+    cache = nullptr;
+    superblock = nullptr;
+    groupDesc = nullptr;
+    groupLocks = nullptr;
+    superblockDirty = false;
+    dirtyDescBlocks.clear();
+    backupSuperblockStale = false;
+    staleBackupDescBlocks.clear();
+    mbrPart = new MBRPartition;
+    if (!mbrPart->Open(map, index))
     {
-        std::cerr << "Failed to Open partition" << partIndex << "\n";
+        std::cerr << "Failed to Open partition" << index << "\n";
         delete mbrPart;
         mbrPart = nullptr;
         return false;
     }
 
-    if (mbrPart->lSeek(EXT2_SUPERBLOCK_OFFSET, SEEK_SET_) != EXT2_SUPERBLOCK_OFFSET)
+    image.Open(mbrPart->vdi);
+    device.Open(&image, mbrPart->partitionOffset, mbrPart->partitionSize);
+
+    superblock = new SuperBlock;
+    if (mbrPart->ReadAt(EXT2_SUPERBLOCK_OFFSET, superblock, EXT2_SUPERBLOCK_SIZE) != EXT2_SUPERBLOCK_SIZE)
+    {
+        std::cerr << "Failed to read superblock" << "\n";
+        delete superblock;
+        superblock = nullptr;
+        return false;
+    }
+    if (superblock->magic != EXT2_SUPER_MAGIC || superblock->blocksPerGroup == 0)
     {
-        std::cerr << "Failed to read superblocks" << "\n";
+        std::cerr << "Invalid superblock magic " << std::hex << superblock->magic << std::dec << "\n";
+        delete superblock;
+        superblock = nullptr;
         return false;
     }
 
-    superblock = new SuperBlock;
-    if (mbrPart->Read(superblock, EXT2_SUPERBLOCK_SIZE) != EXT2_SUPERBLOCK_SIZE)
+    groupCount = (superblock->blocksCount + superblock->blocksPerGroup - 1) / superblock->blocksPerGroup;
+    groupDesc = new BlockGroupDescriptor[groupCount];
+    if (!FetchBGDT(superblock->firstDataBlock + 1, groupDesc))
     {
-        std::cerr << "Failed to read superblock" << "\n";
+        delete[] groupDesc;
+        groupDesc = nullptr;
         delete superblock;
         superblock = nullptr;
         return false;
     }
 
+    uint32_t *freeBlocks = new uint32_t[groupCount];
+    for (uint32_t g = 0; g < groupCount; g++)
+        freeBlocks[g] = groupDesc[g].freeBlocksCount;
+    freeSpace.Init(groupCount, freeBlocks);
+    delete[] freeBlocks;
+    groupLocks = new std::mutex[groupCount];
+
     return true;
 }
 
 void Ext2File::Close()
 {
+    if (groupDesc && !Checkpoint())
+        std::cerr << "Could not write filesystem metadata on close" << "\n";
+    if (cache)
+    {
+        if (!cache->Destroy())
+            std::cerr << "Could not write back cached blocks on close" << "\n";
+        delete cache;
+        cache = nullptr;
+    }
+    if (asyncIO)
+    {
+        asyncIO->Stop();
+        delete asyncIO;
+        asyncIO = nullptr;
+    }
     if (mbrPart)
     {
+        image.Close();
         mbrPart->Close();
         delete mbrPart;
         mbrPart = nullptr;
@@ -74,20 +124,205 @@ void Ext2File::Close()
         delete superblock;
         superblock = nullptr;
     }
+    if (groupDesc)
+    {
+        freeSpace.Destroy();
+        delete[] groupLocks;
+        groupLocks = nullptr;
+        delete[] groupDesc;
+        groupDesc = nullptr;
+    }
 }
 
-bool Ext2File::FetchBlock(uint32_t blockNum, void *buf)
+void Ext2File::MarkGroupDirty(uint32_t group)
 {
     uint32_t blockSize = 1024 << superblock->logBlockSize;
-    uint32_t offset = blockNum * blockSize;
+    std::lock_guard<std::mutex> lock(metadataLock);
+    superblockDirty = true;
+    dirtyDescBlocks.insert(group / (blockSize / sizeof(BlockGroupDescriptor)));
+}
 
-    if (mbrPart->lSeek(offset, SEEK_SET_) != offset)
+// Writes the descriptors of BGDT block index to blockNum, in the primary
+// table or a backup, keeping whatever follows the last descriptor in the final block
+bool Ext2File::WriteDescBlock(uint32_t index, uint32_t blockNum)
+{
+    uint32_t blockSize = 1024 << superblock->logBlockSize;
+    uint32_t descsPerBlock = blockSize / sizeof(BlockGroupDescriptor);
+    uint32_t first = index * descsPerBlock;
+    uint32_t count = groupCount - first < descsPerBlock ? groupCount - first : descsPerBlock;
+
+    uint8_t *buf = new uint8_t[blockSize];
+    bool written = (count == descsPerBlock || FetchBlock(blockNum, buf));
+    if (written)
     {
-        std::cerr << "Failed to seek to block offset" << "\n";
+        // Each descriptor is copied whole under its group's lock
+        for (uint32_t g = first; g < first + count; g++)
+        {
+            std::lock_guard<std::mutex> lock(groupLocks[g]);
+            memcpy(buf + (g - first) * sizeof(BlockGroupDescriptor), &groupDesc[g], sizeof(BlockGroupDescriptor));
+        }
+        written = WriteBlock(blockNum, buf);
+    }
+    delete[] buf;
+    return written;
+}
+
+bool Ext2File::Sync()
+{
+    std::lock_guard<std::mutex> syncing(syncLock);
+
+    // Taken out of the dirty state first, so allocators can go on marking
+    // while it is written; anything not written is put back
+    bool writeSuperblock;
+    std::set<uint32_t> descBlocks;
+    {
+        std::lock_guard<std::mutex> lock(metadataLock);
+        writeSuperblock = superblockDirty;
+        superblockDirty = false;
+        descBlocks.swap(dirtyDescBlocks);
+    }
+
+    bool synced = true;
+    if (writeSuperblock)
+    {
+        superblock->freeBlocksCount = FreeBlocksCount();
+        superblock->freeInodesCount = FreeInodesCount();
+        synced = WriteSuperBlock(0, superblock);
+    }
+
+    std::set<uint32_t> written;
+    while (synced && !descBlocks.empty())
+    {
+        uint32_t index = *descBlocks.begin();
+        if (!WriteDescBlock(index, superblock->firstDataBlock + 1 + index))
+        {
+            std::cerr << "Failed to write BGDT block " << index << "\n";
+            synced = false;
+            break;
+        }
+        written.insert(index);
+        descBlocks.erase(descBlocks.begin());
+    }
+
+    // Whatever reached the primary copies is now owed to the backups
+    std::lock_guard<std::mutex> lock(metadataLock);
+    backupSuperblockStale = backupSuperblockStale || (writeSuperblock && synced);
+    staleBackupDescBlocks.insert(written.begin(), written.end());
+    if (!synced)
+    {
+        superblockDirty = superblockDirty || writeSuperblock;
+        dirtyDescBlocks.insert(descBlocks.begin(), descBlocks.end());
         return false;
     }
+    return Flush();
+}
 
-    ssize_t bytesRead = mbrPart->Read(buf, blockSize);
+// Groups 0 and 1 and the powers of 3, 5 and 7 with sparse_super; every group without it
+bool Ext2File::HasBackup(uint32_t group)
+{
+    if (group <= 1 || !(superblock->featureROCompat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+        return true;
+
+    for (uint64_t base : {3, 5, 7})
+    {
+        uint64_t power = base;
+        while (power < group)
+            power *= base;
+        if (power == group)
+            return true;
+    }
+    return false;
+}
+
+bool Ext2File::Checkpoint()
+{
+    if (!Sync())
+        return false;
+
+    std::lock_guard<std::mutex> syncing(syncLock);
+    bool writeSuperblock;
+    std::set<uint32_t> descBlocks;
+    {
+        std::lock_guard<std::mutex> lock(metadataLock);
+        writeSuperblock = backupSuperblockStale;
+        backupSuperblockStale = false;
+        descBlocks.swap(staleBackupDescBlocks);
+    }
+
+    // Each backup group starts with its superblock copy, followed by the BGDT
+    bool replicated = true;
+    for (uint32_t group = 1; group < groupCount && replicated; group++)
+    {
+        if (!HasBackup(group))
+            continue;
+
+        uint32_t start = group * superblock->blocksPerGroup + superblock->firstDataBlock;
+        if (writeSuperblock)
+        {
+            SuperBlock copy = *superblock;
+            copy.blockGroupNr = group;
+            replicated = WriteSuperBlock(start, &copy);
+        }
+        for (auto it = descBlocks.begin(); it != descBlocks.end() && replicated; ++it)
+            replicated = WriteDescBlock(*it, start + 1 + *it);
+    }
+
+    if (!replicated)
+    {
+        std::cerr << "Failed to replicate metadata to the backup groups" << "\n";
+        std::lock_guard<std::mutex> lock(metadataLock);
+        backupSuperblockStale = backupSuperblockStale || writeSuperblock;
+        staleBackupDescBlocks.insert(descBlocks.begin(), descBlocks.end());
+        return false;
+    }
+    return Flush();
+}
+
+uint32_t Ext2File::FreeBlocksCount()
+{
+    uint32_t count = 0;
+    for (uint32_t g = 0; g < groupCount; g++)
+    {
+        std::lock_guard<std::mutex> lock(groupLocks[g]);
+        count += groupDesc[g].freeBlocksCount;
+    }
+    return count;
+}
+
+uint32_t Ext2File::FreeInodesCount()
+{
+    uint32_t count = 0;
+    for (uint32_t g = 0; g < groupCount; g++)
+    {
+        std::lock_guard<std::mutex> lock(groupLocks[g]);
+        count += groupDesc[g].freeInodesCount;
+    }
+    return count;
+}
+
+uint32_t Ext2File::HomeGroup()
+{
+    // Threads are numbered in the order they first ask
+    static std::atomic<uint32_t> threadsSeen(0);
+    thread_local uint32_t thread = threadsSeen++;
+    return thread % groupCount;
+}
+
+bool Ext2File::FetchBlock(uint32_t blockNum, void *buf)
+{
+    if (cache)
+        return cache->Read(blockNum, buf);
+    return ReadBlockDevice(blockNum, buf);
+}
+
+bool Ext2File::ReadBlockDevice(uint32_t blockNum, void *buf)
+{
+    uint32_t blockSize = 1024 << superblock->logBlockSize;
+    uint64_t offset = static_cast<uint64_t>(blockNum) * blockSize;
+
+    // The partition object is only in the way unless it stages read-ahead data
+    ssize_t bytesRead = mbrPart->ReadAheadEnabled() ? mbrPart->ReadAt(offset, buf, blockSize)
+                                                    : device.ReadAt(offset, buf, blockSize);
     if (bytesRead != static_cast<ssize_t>(blockSize))
     {
         std::cerr << "Failed to read. Wrong number of bytes " << bytesRead << "\n";
@@ -97,17 +332,156 @@ bool Ext2File::FetchBlock(uint32_t blockNum, void *buf)
     return true;
 }
 
-bool Ext2File::WriteBlock(uint32_t blockNum, void *buf)
+bool Ext2File::FetchBlocks(uint32_t firstBlock, uint32_t count, void *buf)
+{
+    uint32_t blockSize = 1024 << superblock->logBlockSize;
+    uint64_t offset = static_cast<uint64_t>(firstBlock) * blockSize;
+    size_t length = static_cast<size_t>(count) * blockSize;
+
+    ssize_t bytesRead = mbrPart->ReadAheadEnabled() ? mbrPart->ReadAt(offset, buf, length)
+                                                    : device.ReadAt(offset, buf, length);
+    if (bytesRead != static_cast<ssize_t>(length))
+    {
+        std::cerr << "Failed to read. Wrong number of bytes " << bytesRead << "\n";
+        return false;
+    }
+
+    // Write-back blocks not yet on the disk are newer than what was just read
+    if (cache)
+        cache->Overlay(firstBlock, count, buf);
+    return true;
+}
+
+bool Ext2File::WriteBlocks(uint32_t firstBlock, uint32_t count, void *buf)
+{
+    uint32_t blockSize = 1024 << superblock->logBlockSize;
+    uint8_t *in = reinterpret_cast<uint8_t*>(buf);
+
+    // Cached blocks must stay current, so they go through the cache one by one
+    if (cache)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!cache->Write(firstBlock + i, in + static_cast<size_t>(i) * blockSize))
+                return false;
+        }
+        return true;
+    }
+
+    uint64_t offset = static_cast<uint64_t>(firstBlock) * blockSize;
+    size_t length = static_cast<size_t>(count) * blockSize;
+    ssize_t bytesWritten = mbrPart->WriteAt(offset, buf, length);
+    if (bytesWritten != static_cast<ssize_t>(length))
+    {
+        std::cerr << "Failed to write. Wrong number of bytes " << bytesWritten << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool Ext2File::EnableAsyncIO(unsigned queueDepth)
+{
+    if (asyncIO)
+        return true;
+
+    asyncIO = new VDIAsyncIO;
+    if (!asyncIO->Start(mbrPart->vdi, queueDepth))
+    {
+        delete asyncIO;
+        asyncIO = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool Ext2File::EnableCache(uint32_t capacity, uint32_t shards, BlockCachePolicy policy)
+{
+    if (cache)
+        return true;
+
+    cache = new BlockCache;
+    if (!cache->Init(1024 << superblock->logBlockSize, capacity, shards, policy,
+                     [this](uint32_t blockNum, void *buf) { return ReadBlockDevice(blockNum, buf); },
+                     [this](uint32_t blockNum, const void *buf) { return WriteBlockDevice(blockNum, buf); }))
+    {
+        delete cache;
+        cache = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool Ext2File::Flush()
+{
+    return !cache || cache->Flush();
+}
+
+bool Ext2File::FetchBlockList(const uint32_t *blockNums, uint32_t count, void *buf)
 {
     uint32_t blockSize = 1024 << superblock->logBlockSize;
-    uint32_t offset = blockNum * blockSize;
+    uint8_t *out = reinterpret_cast<uint8_t*>(buf);
 
-    if (mbrPart->lSeek(offset, SEEK_SET_) != offset)
+    if (!asyncIO)
     {
-        std::cerr << "Failed to seek to block offset" << "\n";
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!FetchBlock(blockNums[i], out + static_cast<size_t>(i) * blockSize))
+                return false;
+        }
+        return true;
+    }
+
+    std::atomic<uint32_t> remaining(count);
+    std::atomic<bool> failed(false);
+    std::promise<void> done;
+
+    std::vector<VDIAsyncRequest> requests(count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t offset = static_cast<uint64_t>(blockNums[i]) * blockSize;
+        if (offset + blockSize > mbrPart->partitionSize)
+        {
+            std::cerr << "Block " << blockNums[i] << " outside partition" << "\n";
+            return false;
+        }
+
+        requests[i] = {false, mbrPart->partitionOffset + offset, out + static_cast<size_t>(i) * blockSize, blockSize,
+                       [&, blockSize](ssize_t result)
+                       {
+                           if (result != static_cast<ssize_t>(blockSize))
+                               failed = true;
+                           if (--remaining == 0)
+                               done.set_value();
+                       }};
+    }
+
+    if (count == 0)
+        return true;
+    if (!asyncIO->Submit(requests.data(), count))
         return false;
+
+    done.get_future().wait();
+    if (cache)
+    {
+        for (uint32_t i = 0; i < count; i++)
+            cache->Overlay(blockNums[i], 1, out + static_cast<size_t>(i) * blockSize);
     }
-    ssize_t bytesWritten = mbrPart->Write(buf, blockSize);
+    return !failed;
+}
+
+bool Ext2File::WriteBlock(uint32_t blockNum, void *buf)
+{
+    if (cache)
+        return cache->Write(blockNum, buf);
+    return WriteBlockDevice(blockNum, buf);
+}
+
+bool Ext2File::WriteBlockDevice(uint32_t blockNum, const void *buf)
+{
+    uint32_t blockSize = 1024 << superblock->logBlockSize;
+    uint64_t offset = static_cast<uint64_t>(blockNum) * blockSize;
+
+    ssize_t bytesWritten = mbrPart->WriteAt(offset, buf, blockSize);
 
     if (bytesWritten != static_cast<ssize_t>(blockSize))
     {
@@ -120,14 +494,23 @@ bool Ext2File::WriteBlock(uint32_t blockNum, void *buf)
 
 bool Ext2File::FetchSuperBlock(uint32_t blockNum, struct SuperBlock *sb)
 {
-    if (blockNum == 0)
+    if (blockNum == 0 && cache)
     {
-        if (mbrPart->lSeek(EXT2_SUPERBLOCK_OFFSET, SEEK_SET_) != EXT2_SUPERBLOCK_OFFSET)
+        // The cache may hold a newer copy of the block the superblock sits in
+        uint32_t blockSize = 1024 << superblock->logBlockSize;
+        uint8_t *buf = new uint8_t[blockSize];
+        if (!FetchBlock(EXT2_SUPERBLOCK_OFFSET / blockSize, buf))
         {
-            std::cerr << "Failed to seek main superblock offset" << "\n";
+            std::cerr << "Failed to read main superblock" << "\n";
+            delete[] buf;
             return false;
         }
-        if (mbrPart->Read(sb, EXT2_SUPERBLOCK_SIZE) != EXT2_SUPERBLOCK_SIZE)
+        memcpy(sb, buf + EXT2_SUPERBLOCK_OFFSET % blockSize, EXT2_SUPERBLOCK_SIZE);
+        delete[] buf;
+    }
+    else if (blockNum == 0)
+    {
+        if (mbrPart->ReadAt(EXT2_SUPERBLOCK_OFFSET, sb, EXT2_SUPERBLOCK_SIZE) != EXT2_SUPERBLOCK_SIZE)
         {
             std::cerr << "Failed to read main superblock" << "\n";
             return false;
@@ -141,6 +524,7 @@ bool Ext2File::FetchSuperBlock(uint32_t blockNum, struct SuperBlock *sb)
         if (!FetchBlock(blockNum, buf))
         {
             std::cerr << "Failed to fetch backup superblock" << "\n";
+            delete[] buf;
             return false;
         }
         memcpy(sb, buf, EXT2_SUPERBLOCK_SIZE);
@@ -158,14 +542,27 @@ bool Ext2File::FetchSuperBlock(uint32_t blockNum, struct SuperBlock *sb)
 
 bool Ext2File::WriteSuperBlock(uint32_t blockNum, struct SuperBlock *sb)
 {
-    if (blockNum == 0)
+    if (blockNum == 0 && cache)
     {
-        if (mbrPart->lSeek(EXT2_SUPERBLOCK_OFFSET, SEEK_SET_) != EXT2_SUPERBLOCK_OFFSET)
+        // Patched into its block so the cached copy stays current
+        uint32_t blockSize = 1024 << superblock->logBlockSize;
+        uint8_t *buf = new uint8_t[blockSize];
+        bool written = FetchBlock(EXT2_SUPERBLOCK_OFFSET / blockSize, buf);
+        if (written)
+        {
+            memcpy(buf + EXT2_SUPERBLOCK_OFFSET % blockSize, sb, EXT2_SUPERBLOCK_SIZE);
+            written = WriteBlock(EXT2_SUPERBLOCK_OFFSET / blockSize, buf);
+        }
+        delete[] buf;
+        if (!written)
         {
-            std::cerr << "Failed to seek main superblock offset" << "\n";
+            std::cerr << "Failed to write main superblock" << "\n";
             return false;
         }
-        if (mbrPart->Write(sb, EXT2_SUPERBLOCK_SIZE) != EXT2_SUPERBLOCK_SIZE)
+    }
+    else if (blockNum == 0)
+    {
+        if (mbrPart->WriteAt(EXT2_SUPERBLOCK_OFFSET, sb, EXT2_SUPERBLOCK_SIZE) != EXT2_SUPERBLOCK_SIZE)
         {
             std::cerr << "Failed to write main superblock" << "\n";
             return false;
@@ -173,16 +570,22 @@ bool Ext2File::WriteSuperBlock(uint32_t blockNum, struct SuperBlock *sb)
     }
     else
     {
+        // Patched into its block: the fields past the struct and the rest of
+        // the block stay as they are on disk
         uint32_t blockSize = 1024 << superblock->logBlockSize;
         uint8_t *buf = new uint8_t[blockSize];
-
-        memcpy(buf, sb, EXT2_SUPERBLOCK_SIZE);
-        if (!WriteBlock(blockNum, buf))
+        bool written = FetchBlock(blockNum, buf);
+        if (written)
         {
-            std::cerr << "Failed to fetch backup superblock" << "\n";
-            return false;
+            memcpy(buf, sb, EXT2_SUPERBLOCK_SIZE);
+            written = WriteBlock(blockNum, buf);
         }
         delete[] buf;
+        if (!written)
+        {
+            std::cerr << "Failed to write backup superblock" << "\n";
+            return false;
+        }
     }
 
     return true;
@@ -197,14 +600,11 @@ bool Ext2File::FetchBGDT(uint32_t blockNum, BlockGroupDescriptor *bgdt)
 
     uint8_t *tmp = new uint8_t[blocksNeeded * blockSize];
 
-    for (uint32_t i = 0; i < blocksNeeded; i++)
+    if (!FetchBlocks(blockNum, blocksNeeded, tmp))
     {
-        if (!FetchBlock(blockNum + i, tmp + i * blockSize))
-        {
-            std::cerr << "FetchBGDT failed to fetch block " << (blockNum + i) << "\n";
-            delete[] tmp;
-            return false;
-        }
+        std::cerr << "FetchBGDT failed to fetch blocks at " << blockNum << "\n";
+        delete[] tmp;
+        return false;
     }
 
     memcpy(bgdt, tmp, totalBytes);
@@ -236,95 +636,179 @@ bool Ext2File::WriteBGDT(uint32_t blockNum, BlockGroupDescriptor *bgdt)
     return true;
 }
 
-uint32_t Ext2File::AllocateBlock()
+uint32_t Ext2File::AllocateBlock(uint32_t goal)
+{
+    std::vector<BlockExtent> extents;
+    return AllocateBlocks(1, goal, extents) == 1 ? extents[0].start : 0;
+}
+
+uint32_t Ext2File::AllocateBlocks(uint32_t count, uint32_t goal, std::vector<BlockExtent> &extents)
 {
-    uint32_t blockSize = 1024 << superblock->logBlockSize;
     uint32_t blocksPerGroup = superblock->blocksPerGroup;
-    uint32_t totalGroups = (superblock->blocksCount + blocksPerGroup - 1) / blocksPerGroup;
+    if (goal == 0)
+        goal = HomeGroup() * blocksPerGroup + superblock->firstDataBlock;
+    if (goal < superblock->firstDataBlock || goal >= superblock->blocksCount)
+        goal = superblock->firstDataBlock;
+    uint32_t goalGroup = (goal - superblock->firstDataBlock) / blocksPerGroup;
+    uint32_t goalBit = (goal - superblock->firstDataBlock) % blocksPerGroup;
+
+    // The goal's own group is tried from the goal on, then the index names the
+    // nearest group that may do; the first pass only takes runs that finish the
+    // request. A group that gives nothing is measured by the attempt, so the
+    // index stops naming it.
+    uint32_t taken = 0;
+    for (int pass = 0; pass < 2 && taken < count; pass++)
+    {
+        bool wholeRun = pass == 0;
+        taken += AllocateInGroup(goalGroup, goalBit, GroupBlockCount(goalGroup), wholeRun, goalBit, count - taken, extents);
 
-    BlockGroupDescriptor* groupDesc = new BlockGroupDescriptor[totalGroups];
-    if (!FetchBGDT(superblock->firstDataBlock + 1, groupDesc))
+        while (taken < count)
+        {
+            uint32_t needed = wholeRun ? count - taken : 1;
+            int32_t group = freeSpace.Find(goalGroup, needed);
+            if (group < 0)
+                break;
+
+            uint32_t got = AllocateInGroup(group, 0, GroupBlockCount(group), wholeRun, UINT32_MAX, count - taken, extents);
+            if (got == 0 && freeSpace.LongestRun(group) >= needed)
+                break;
+            taken += got;
+        }
+    }
+    return taken;
+}
+
+void Ext2File::MeasureGroup(uint32_t group, const uint8_t *bitmap)
+{
+    uint32_t start;
+    uint32_t longest = BitmapLongestZeroRun(bitmap, 0, GroupBlockCount(group), start);
+    freeSpace.Update(group, start, longest);
+}
+
+uint32_t Ext2File::GroupBlockCount(uint32_t group)
+{
+    // The last group ends with the disk
+    uint32_t blocks = superblock->blocksCount - superblock->firstDataBlock - group * superblock->blocksPerGroup;
+    return blocks < superblock->blocksPerGroup ? blocks : superblock->blocksPerGroup;
+}
+
+// Takes free runs from bits [first, last) of the group's bitmap until count
+// blocks are taken. With wholeRun a run is only taken if it holds all of them
+// or starts at anchor. The bitmap is written once for the whole call.
+uint32_t Ext2File::AllocateInGroup(uint32_t group, uint32_t first, uint32_t last, bool wholeRun, uint32_t anchor,
+                                   uint32_t count, std::vector<BlockExtent> &extents)
+{
+    std::lock_guard<std::mutex> lock(groupLocks[group]);
+    if (first >= last || count == 0 || groupDesc[group].freeBlocksCount == 0)
+        return 0;
+
+    uint32_t blockSize = 1024 << superblock->logBlockSize;
+    uint8_t *bitmap = new uint8_t[blockSize];
+    if (!FetchBlock(groupDesc[group].blockBitmap, bitmap))
     {
-        delete[] groupDesc;
+        delete[] bitmap;
         return 0;
     }
 
-    int32_t group = -1;
-    for (uint32_t g = 0; g < totalGroups; g++)
+    uint32_t base = group * superblock->blocksPerGroup + superblock->firstDataBlock;
+    std::vector<BlockExtent> runs;
+    uint32_t taken = 0;
+    uint32_t bit = first;
+
+    while (bit < last && taken < count)
     {
-        if (groupDesc[g].freeBlocksCount > 0)
-        {
-            group = g;
+        uint32_t runStart = BitmapFindZero(bitmap, bit, last);
+        if (runStart == last)
             break;
-        }
+
+        // The run is only measured as far as it is needed
+        uint32_t needed = count - taken;
+        bit = BitmapFindOne(bitmap, runStart, last - runStart > needed ? runStart + needed : last);
+        uint32_t runLength = bit - runStart;
+        if (wholeRun && runLength < needed && runStart != anchor)
+            continue;
+
+        BitmapSet(bitmap, runStart, runLength);
+        runs.push_back({base + runStart, runLength});
+        taken += runLength;
     }
 
-    if (group < 0)
+    if (taken == 0)
     {
-        delete[] groupDesc;
+        // The scan found too little, which the index should know next time
+        if (!freeSpace.IsExact(group))
+            MeasureGroup(group, bitmap);
+        delete[] bitmap;
         return 0;
     }
-
-    uint8_t *buf = new uint8_t[blockSize];
-    if (!FetchBlock(groupDesc[group].blockBitmap, buf))
+    if (!WriteBlock(groupDesc[group].blockBitmap, bitmap))
     {
-        delete[] buf;
-        delete[] groupDesc;
+        delete[] bitmap;
         return 0;
     }
 
-    uint32_t newBlock = 0;
-    bool allocated = false;
+    groupDesc[group].freeBlocksCount -= taken;
+    MarkGroupDirty(group);
+
+    // The longest run only has to be measured again if it was cut into
+    bool cut = !freeSpace.IsExact(group);
+    uint32_t longestStart = base + freeSpace.RunStart(group);
+    for (const BlockExtent &run : runs)
+        cut = cut || (run.start < longestStart + freeSpace.LongestRun(group) && longestStart < run.start + run.count);
+    if (cut)
+        MeasureGroup(group, bitmap);
+    delete[] bitmap;
 
-    for (uint32_t b = 0; b < blockSize && b * 8 < blocksPerGroup; b++)
+    // Runs that meet across a group boundary become one extent
+    for (const BlockExtent &run : runs)
     {
-        if (buf[b] != 0xFF)
-        {
-            for (int bit = 0; bit < 8; bit++)
-            {
-                uint32_t blockIndex = b * 8 + bit;
-
-                if (blockIndex >= blocksPerGroup)
-                    break;
-
-                if (!(buf[b] & (1 << bit)))
-                {
-                    buf[b] |= (1 << bit);
-                    newBlock = group * blocksPerGroup + blockIndex + superblock->firstDataBlock;
-
-                    if (newBlock < superblock->blocksCount)
-                    {
-                        allocated = true;
-                        break;
-                    }
-                }
-            }
-        }
-        if (allocated)
-            break;
+        if (!extents.empty() && extents.back().start + extents.back().count == run.start)
+            extents.back().count += run.count;
+        else
+            extents.push_back(run);
     }
+    return taken;
+}
 
-    if (!allocated)
+bool Ext2File::FreeBlocks(uint32_t firstBlock, uint32_t count)
+{
+    if (firstBlock < superblock->firstDataBlock || count > superblock->blocksCount - firstBlock)
     {
-        delete[] buf;
-        delete[] groupDesc;
-        return 0;
+        std::cerr << "Cannot free blocks " << firstBlock << "+" << count << " outside the filesystem" << "\n";
+        return false;
     }
 
-    if (!WriteBlock(groupDesc[group].blockBitmap, buf))
+    uint32_t blockSize = 1024 << superblock->logBlockSize;
+    uint8_t *bitmap = new uint8_t[blockSize];
+    bool freed = true;
+
+    while (count > 0 && freed)
     {
-        delete[] buf;
-        delete[] groupDesc;
-        return 0;
-    }
+        uint32_t group = (firstBlock - superblock->firstDataBlock) / superblock->blocksPerGroup;
+        uint32_t bit = (firstBlock - superblock->firstDataBlock) % superblock->blocksPerGroup;
+        uint32_t length = superblock->blocksPerGroup - bit < count ? superblock->blocksPerGroup - bit : count;
+
+        // Blocks already free are left out of the counts
+        std::lock_guard<std::mutex> lock(groupLocks[group]);
+        freed = FetchBlock(groupDesc[group].blockBitmap, bitmap);
+        uint32_t cleared = freed ? BitmapCount(bitmap, bit, bit + length) : 0;
+        BitmapClear(bitmap, bit, length);
 
-    superblock->freeBlocksCount--;
-    groupDesc[group].freeBlocksCount--;
+        if (freed && cleared > 0)
+        {
+            freed = WriteBlock(groupDesc[group].blockBitmap, bitmap);
+            if (freed)
+            {
+                groupDesc[group].freeBlocksCount += cleared;
+                MarkGroupDirty(group);
+                MeasureGroup(group, bitmap);
+            }
+        }
 
-    WriteSuperBlock(superblock->firstDataBlock, superblock);
-    WriteBGDT(superblock->firstDataBlock + 1, groupDesc);
+        firstBlock += length;
+        count -= length;
+    }
 
-    delete[] buf;
-    delete[] groupDesc;
-    return newBlock;
+    delete[] bitmap;
+    return freed;
 }
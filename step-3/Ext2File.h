@@ -1,7 +1,14 @@
 #ifndef OS_PROJECT_EXT2FILE_H
 #define OS_PROJECT_EXT2FILE_H
 
+#include "../step-2/BlockDevice.h"
 #include "../step-2/MBRPartition.h"
+#include "../step-1/VDIAsyncIO.h"
+#include "BlockCache.h"
+#include "FreeSpaceIndex.h"
+#include <mutex>
+#include <set>
+#include <vector>
 
 #ifndef OS_EXT2SUPERBLOCK_H
 #define OS_EXT2SUPERBLOCK_H
@@ -73,18 +80,92 @@ struct BlockGroupDescriptor
 #pragma pack(pop)
 #endif
 
+// A run of contiguous blocks handed out by the allocator
+struct BlockExtent
+{
+    uint32_t start;
+    uint32_t count;
+};
+
 
 class Ext2File
 {
+private:
+    // Block path of the filesystem: the partition folded into one offset over the image
+    VDIDevice image;
+    PartitionWindow<VDIDevice> device;
+    bool ReadBlockDevice(uint32_t blockNum, void *buf);
+    bool WriteBlockDevice(uint32_t blockNum, const void *buf);
+
+    // Metadata changed in memory and not yet written; see Sync
+    bool superblockDirty;
+    std::set<uint32_t> dirtyDescBlocks;     // Indexes of BGDT blocks, counted from the first
+    // Metadata on the primary copies but not yet replicated to the backups; see Checkpoint
+    bool backupSuperblockStale;
+    std::set<uint32_t> staleBackupDescBlocks;
+    std::mutex metadataLock;                // Guards the four above
+    std::mutex syncLock;                    // One Sync or Checkpoint at a time
+    bool WriteDescBlock(uint32_t index, uint32_t blockNum);
+    bool HasBackup(uint32_t group);
+
+    // One lock per group guards its descriptor and its bitmaps
+    std::mutex *groupLocks;
+
+    // Longest free run of every group, kept current by the block allocator
+    FreeSpaceIndex freeSpace;
+    void MeasureGroup(uint32_t group, const uint8_t *bitmap);
+
+    uint32_t GroupBlockCount(uint32_t group);
+    uint32_t AllocateInGroup(uint32_t group, uint32_t first, uint32_t last, bool wholeRun, uint32_t anchor,
+                             uint32_t count, std::vector<BlockExtent> &extents);
 public:
     MBRPartition *mbrPart;
+    // The superblock and block group descriptor table are read at Open and are
+    // the authoritative copies from then on; changes reach the disk with Sync
     SuperBlock *superblock;
+    BlockGroupDescriptor *groupDesc;
+    uint32_t groupCount;
+    VDIAsyncIO *asyncIO;
+    BlockCache *cache;          // nullptr until EnableCache
 
+    // Opens the first Linux partition of the image, MBR or GPT
     bool Open(char *fn);
+    // Opens partition index of a map that is already scanned, sharing its image
+    bool Open(PartitionMap *map, uint32_t index);
     void Close();
 
     bool FetchBlock(uint32_t blockNum, void *buf);
     bool WriteBlock(uint32_t blockNum, void *buf);
+    bool FetchBlocks(uint32_t firstBlock, uint32_t count, void *buf);
+    bool WriteBlocks(uint32_t firstBlock, uint32_t count, void *buf);
+
+    // Reads scattered blocks with every request in flight at once when async I/O is enabled
+    bool EnableAsyncIO(unsigned queueDepth = 64);
+    bool FetchBlockList(const uint32_t *blockNums, uint32_t count, void *buf);
+
+    // Serves FetchBlock and WriteBlock from a cache of capacity blocks split
+    // over shards locks; write-back blocks reach the disk on eviction, Flush or Close
+    bool EnableCache(uint32_t capacity = 1024, uint32_t shards = 16, BlockCachePolicy policy = BLOCK_CACHE_WRITE_THROUGH);
+    bool Flush();
+
+    // Records that the group's descriptor and the superblock counters changed
+    void MarkGroupDirty(uint32_t group);
+    // Writes the superblock and every changed BGDT block, then flushes the cache
+    bool Sync();
+    // Syncs, then copies the superblock and the BGDT blocks changed since the
+    // last checkpoint to every group holding a backup, each block written once
+    // per group. Close checkpoints.
+    bool Checkpoint();
+
+    // Allocation is safe from several threads. Each group's descriptor and
+    // bitmaps are changed under its lock, and the allocators only count in the
+    // descriptors: the superblock totals are their sum, folded in by Sync.
+    std::mutex &GroupLock(uint32_t group) { return groupLocks[group]; }
+    uint32_t FreeBlocksCount();
+    uint32_t FreeInodesCount();
+    // The group a thread allocates in when it gives no goal. Threads are handed
+    // different groups, so parallel writers neither contend nor interleave.
+    uint32_t HomeGroup();
 
     bool FetchSuperBlock(uint32_t blockNum, struct SuperBlock *sb);
     bool WriteSuperBlock(uint32_t blockNum, struct SuperBlock *sb);
@@ -92,7 +173,16 @@ public:
     bool FetchBGDT(uint32_t blockNum, BlockGroupDescriptor *bgdt);
     bool WriteBGDT(uint32_t blockNum, BlockGroupDescriptor *bgdt);
 
-    uint32_t AllocateBlock();
+    // Allocates the free block nearest after goal, or 0 when the disk is full.
+    // A goal of 0 stands for the start of the thread's home group.
+    uint32_t AllocateBlock(uint32_t goal = 0);
+    // Allocates count blocks as few extents as it can, searching from goal: a run
+    // starting at goal is taken first, then a run holding all the rest in the
+    // nearest group that has one, and only then whatever free blocks follow.
+    // Groups are picked from the free space index without reading bitmaps.
+    // Returns the number allocated, short of count only when the disk is full.
+    uint32_t AllocateBlocks(uint32_t count, uint32_t goal, std::vector<BlockExtent> &extents);
+    bool FreeBlocks(uint32_t firstBlock, uint32_t count);
 };
 
 
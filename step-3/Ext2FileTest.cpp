@@ -1,9 +1,14 @@
 #include "../step-3/Ext2File.h"
+#include "../step-3/Bitmap.h"
+#include "../step-3/FreeSpaceIndex.h"
 #include <cstdio>
 #include <ctime>
 #include <cstring>
 #include <cctype>
+#include <cstdlib>
 #include <iostream>
+#include <set>
+#include <thread>
 
 void DisplayBufferPage(uint8_t *buf, uint32_t count, uint32_t skip, uint64_t offset)
 {
@@ -206,6 +211,287 @@ bool PrintGroup(uint32_t group, Ext2File *extFile, SuperBlock *sb)
     return true;
 }
 
+void TestBlockCache(char *filePath, BlockCachePolicy policy, uint32_t blocks)
+{
+    Ext2File plain, cached;
+    if (!plain.Open(filePath) || !cached.Open(filePath) || !cached.EnableCache(64, 4, policy))
+    {
+        std::cerr << "BlockCache: Open failed" << std::endl;
+        return;
+    }
+
+    // Two passes over more blocks than the cache holds, then two over a hot set
+    uint32_t blockSize = 1024 << plain.superblock->logBlockSize;
+    uint8_t *expected = new uint8_t[blockSize];
+    uint8_t *actual = new uint8_t[blockSize];
+    bool matched = true;
+    for (int pass = 0; pass < 4; pass++)
+    {
+        uint32_t limit = pass < 2 ? blocks : 32;
+        for (uint32_t b = 0; matched && b < limit; b++)
+        {
+            plain.FetchBlock(b, expected);
+            matched = cached.FetchBlock(b, actual) && memcmp(expected, actual, blockSize) == 0;
+        }
+    }
+
+    // Rewriting a block with its own contents leaves the image as it was
+    matched = matched && cached.FetchBlock(1, actual) && cached.WriteBlock(1, actual) && cached.Flush();
+
+    BlockCacheStats stats = cached.cache->GetStats();
+    if (matched)
+        std::cout << "BlockCache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions
+                  << " evictions, " << stats.writeBacks << " write-backs" << std::endl;
+    else
+        std::cerr << "BlockCache: Failed" << std::endl;
+    delete[] expected;
+    delete[] actual;
+    cached.Close();
+    plain.Close();
+}
+
+void TestDeferredMetadata(char *filePath)
+{
+    Ext2File extFile;
+    if (!extFile.Open(filePath))
+    {
+        std::cerr << "DeferredMetadata: Open failed" << std::endl;
+        return;
+    }
+
+    // Allocation only changes the resident copies; the disk catches up on Sync
+    BlockGroupDescriptor *onDisk = new BlockGroupDescriptor[extFile.groupCount];
+    uint32_t freeBefore = extFile.FreeBlocksCount();
+    uint32_t block = extFile.AllocateBlock();
+    uint32_t group = (block - extFile.superblock->firstDataBlock) / extFile.superblock->blocksPerGroup;
+
+    extFile.FetchBGDT(extFile.superblock->firstDataBlock + 1, onDisk);
+    bool deferred = block != 0 && extFile.FreeBlocksCount() == freeBefore - 1 &&
+                    onDisk[group].freeBlocksCount == extFile.groupDesc[group].freeBlocksCount + 1;
+
+    extFile.Sync();
+    SuperBlock sb;
+    extFile.FetchBGDT(extFile.superblock->firstDataBlock + 1, onDisk);
+    bool synced = extFile.FetchSuperBlock(0, &sb) && sb.freeBlocksCount == freeBefore - 1 &&
+                  onDisk[group].freeBlocksCount == extFile.groupDesc[group].freeBlocksCount;
+
+    if (deferred && synced)
+        std::cout << "DeferredMetadata: Block " << block << " in group " << group << " written on Sync" << std::endl;
+    else
+        std::cerr << "DeferredMetadata: Failed" << std::endl;
+    delete[] onDisk;
+    extFile.Close();
+}
+
+void TestAllocateBlocks(char *filePath, uint32_t count)
+{
+    Ext2File extFile;
+    if (!extFile.Open(filePath))
+    {
+        std::cerr << "AllocateBlocks: Open failed" << std::endl;
+        return;
+    }
+
+    // Aim at the start of the second group so the run has room to be contiguous
+    uint32_t goal = extFile.superblock->firstDataBlock + extFile.superblock->blocksPerGroup;
+    uint32_t freeBefore = extFile.FreeBlocksCount();
+    std::vector<BlockExtent> extents;
+    uint32_t allocated = extFile.AllocateBlocks(count, goal, extents);
+
+    std::cout << "AllocateBlocks: " << allocated << " blocks in " << extents.size() << " extents:";
+    for (const BlockExtent &extent : extents)
+        std::cout << " " << extent.start << "+" << extent.count;
+    std::cout << std::endl;
+
+    bool counted = allocated == count && extFile.FreeBlocksCount() == freeBefore - count;
+    for (const BlockExtent &extent : extents)
+        extFile.FreeBlocks(extent.start, extent.count);
+
+    if (!counted || extFile.FreeBlocksCount() != freeBefore)
+        std::cerr << "AllocateBlocks: Free block count is wrong" << std::endl;
+    extFile.Close();
+}
+
+// Checks the bitmap scans against a bit-at-a-time walk over random bitmaps,
+// from nearly empty to nearly full, with ranges that start and end mid-word
+void TestBitmap(uint32_t bits)
+{
+    uint8_t *bitmap = new uint8_t[(bits + 7) / 8];
+    uint32_t failures = 0;
+    srand(1);
+
+    for (int density = 0; density <= 100; density += 10)
+    {
+        for (uint32_t i = 0; i < bits; i++)
+        {
+            if (rand() % 100 < (density == 100 ? 99 : density))
+                BitmapSet(bitmap, i, 1);
+            else
+                BitmapClear(bitmap, i, 1);
+        }
+
+        uint32_t first = rand() % 100;
+        uint32_t last = bits - rand() % 100;
+        uint32_t zero = first, one = first, count = 0;
+        while (zero < last && BitmapTest(bitmap, zero))
+            zero++;
+        while (one < last && !BitmapTest(bitmap, one))
+            one++;
+        for (uint32_t i = first; i < last; i++)
+            count += BitmapTest(bitmap, i);
+
+        uint32_t run = last;
+        for (uint32_t i = first, length = 0; i < last; i++)
+        {
+            length = BitmapTest(bitmap, i) ? 0 : length + 1;
+            if (length == 3)
+            {
+                run = i - 2;
+                break;
+            }
+        }
+
+        if (BitmapFindZero(bitmap, first, last) != zero || BitmapFindOne(bitmap, first, last) != one ||
+            BitmapCount(bitmap, first, last) != count || BitmapFindZeroRun(bitmap, first, last, 3) != run)
+        {
+            std::cerr << "Bitmap: Mismatch at density " << density << "%" << std::endl;
+            failures++;
+        }
+    }
+
+    std::cout << "Bitmap: " << failures << " failures over " << bits << " bits" << std::endl;
+    delete[] bitmap;
+}
+
+// Checks index lookups against a linear walk over the groups, as runs are
+// measured and change under it
+void TestFreeSpaceIndex(uint32_t groups)
+{
+    uint32_t *runs = new uint32_t[groups];
+    for (uint32_t g = 0; g < groups; g++)
+        runs[g] = rand() % 4 == 0 ? 0 : rand() % 8192;
+
+    FreeSpaceIndex index;
+    index.Init(groups, runs);
+    uint32_t failures = 0;
+
+    for (uint32_t i = 0; i < 10000; i++)
+    {
+        uint32_t group = rand() % groups;
+        runs[group] = rand() % 8192;
+        index.Update(group, 0, runs[group]);
+
+        uint32_t goal = rand() % groups;
+        uint32_t length = 1 + rand() % 8192;
+        int32_t expected = -1;
+        for (uint32_t n = 0; n < groups && expected < 0; n++)
+        {
+            if (runs[(goal + n) % groups] >= length)
+                expected = (goal + n) % groups;
+        }
+        if (index.Find(goal, length) != expected)
+            failures++;
+    }
+
+    std::cout << "FreeSpaceIndex: " << failures << " failures over " << groups << " groups" << std::endl;
+    index.Destroy();
+    delete[] runs;
+}
+
+// Allocates from several threads at once; every thread should land in its own
+// group, no block may be handed out twice, and the counts must add up
+void TestParallelAllocation(char *filePath, uint32_t threads, uint32_t blocksPerThread)
+{
+    Ext2File extFile;
+    if (!extFile.Open(filePath))
+    {
+        std::cerr << "ParallelAllocation: Open failed" << std::endl;
+        return;
+    }
+    extFile.EnableCache(1024, 16, BLOCK_CACHE_WRITE_BACK);
+
+    uint32_t freeBefore = extFile.FreeBlocksCount();
+    std::vector<std::vector<BlockExtent>> extents(threads);
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]()
+                             {
+                                 // Small requests, as a file import makes them
+                                 for (uint32_t n = 0; n < blocksPerThread; n += 16)
+                                     extFile.AllocateBlocks(16, 0, extents[t]);
+                             });
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+
+    std::set<uint32_t> seen;
+    uint32_t allocated = 0, runs = 0;
+    for (uint32_t t = 0; t < threads; t++)
+    {
+        for (const BlockExtent &extent : extents[t])
+        {
+            for (uint32_t b = extent.start; b < extent.start + extent.count; b++)
+                seen.insert(b);
+            allocated += extent.count;
+        }
+        runs += extents[t].size();
+    }
+
+    std::cout << "ParallelAllocation: " << allocated << " blocks in " << runs << " extents over " << threads
+              << " threads" << std::endl;
+    if (seen.size() != allocated || extFile.FreeBlocksCount() != freeBefore - allocated)
+        std::cerr << "ParallelAllocation: Blocks handed out twice or miscounted" << std::endl;
+
+    for (uint32_t t = 0; t < threads; t++)
+    {
+        for (const BlockExtent &extent : extents[t])
+            extFile.FreeBlocks(extent.start, extent.count);
+    }
+    extFile.Close();
+}
+
+// After a checkpoint every backup group should carry the current counts, with
+// its own group number in its superblock copy
+void TestBackupReplication(char *filePath)
+{
+    Ext2File extFile;
+    if (!extFile.Open(filePath))
+    {
+        std::cerr << "BackupReplication: Open failed" << std::endl;
+        return;
+    }
+
+    uint32_t block = extFile.AllocateBlock();
+    if (block == 0 || !extFile.Checkpoint())
+    {
+        std::cerr << "BackupReplication: Checkpoint failed" << std::endl;
+        extFile.Close();
+        return;
+    }
+
+    BlockGroupDescriptor *backup = new BlockGroupDescriptor[extFile.groupCount];
+    uint32_t backups = 0, stale = 0;
+    for (uint32_t group = 1; group < extFile.groupCount; group++)
+    {
+        uint32_t start = group * extFile.superblock->blocksPerGroup + extFile.superblock->firstDataBlock;
+        SuperBlock sb;
+        if (!extFile.FetchSuperBlock(start, &sb))
+            continue;
+
+        backups++;
+        if (sb.blockGroupNr != group || sb.freeBlocksCount != extFile.FreeBlocksCount() ||
+            !extFile.FetchBGDT(start + 1, backup) ||
+            memcmp(backup, extFile.groupDesc, extFile.groupCount * sizeof(BlockGroupDescriptor)) != 0)
+            stale++;
+    }
+
+    std::cout << "BackupReplication: " << backups << " backups, " << stale << " stale" << std::endl;
+    delete[] backup;
+    extFile.FreeBlocks(block, 1);
+    extFile.Close();
+}
+
 int main()
 {
     Ext2File *extFile = new Ext2File;
@@ -236,5 +522,14 @@ int main()
 
     extFile->Close();
     delete extFile;
+
+//    TestBlockCache(filename, BLOCK_CACHE_WRITE_THROUGH, 256);
+//    TestBlockCache(filename, BLOCK_CACHE_WRITE_BACK, 256);
+//    TestDeferredMetadata(filename);
+//    TestAllocateBlocks(filename, 300);
+//    TestBitmap(8192);
+//    TestFreeSpaceIndex(20000);
+//    TestParallelAllocation(filename, 4, 4096);
+//    TestBackupReplication(filename);
     return 0;
 }
@@ -0,0 +1,98 @@
+#include <cstring>
+#include "FreeSpaceIndex.h"
+
+void FreeSpaceIndex::Init(uint32_t groups, const uint32_t *freeBlocks)
+{
+    groupCount = groups;
+    leaves = 1;
+    while (leaves < groups)
+        leaves *= 2;
+
+    tree = new uint32_t[2 * leaves];
+    runStart = new uint32_t[groups];
+    exact = new bool[groups];
+    memset(tree, 0, sizeof(uint32_t) * 2 * leaves);
+    memset(runStart, 0, sizeof(uint32_t) * groups);
+    memset(exact, 0, sizeof(bool) * groups);
+
+    for (uint32_t g = 0; g < groups; g++)
+        tree[leaves + g] = freeBlocks[g];
+    for (uint32_t node = leaves - 1; node > 0; node--)
+        tree[node] = tree[2 * node] > tree[2 * node + 1] ? tree[2 * node] : tree[2 * node + 1];
+}
+
+void FreeSpaceIndex::Destroy()
+{
+    delete[] tree;
+    delete[] runStart;
+    delete[] exact;
+    tree = nullptr;
+    runStart = nullptr;
+    exact = nullptr;
+}
+
+void FreeSpaceIndex::Update(uint32_t group, uint32_t start, uint32_t longestRun)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    exact[group] = true;
+    runStart[group] = start;
+
+    uint32_t node = leaves + group;
+    tree[node] = longestRun;
+    for (node /= 2; node > 0; node /= 2)
+    {
+        uint32_t longest = tree[2 * node] > tree[2 * node + 1] ? tree[2 * node] : tree[2 * node + 1];
+        if (tree[node] == longest)
+            break;
+        tree[node] = longest;
+    }
+}
+
+// First group of [first, last) under node, which covers [low, high), whose run
+// is at least length. Subtrees whose maximum is too short are never entered.
+int32_t FreeSpaceIndex::FindIn(uint32_t node, uint32_t low, uint32_t high, uint32_t first, uint32_t last, uint32_t length)
+{
+    if (high <= first || low >= last || tree[node] < length)
+        return -1;
+    if (high - low == 1)
+        return low;
+
+    uint32_t middle = low + (high - low) / 2;
+    int32_t group = FindIn(2 * node, low, middle, first, last, length);
+    if (group < 0)
+        group = FindIn(2 * node + 1, middle, high, first, last, length);
+    return group;
+}
+
+int32_t FreeSpaceIndex::Find(uint32_t goal, uint32_t length)
+{
+    if (length == 0)
+        length = 1;
+    if (goal >= groupCount)
+        goal = 0;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    int32_t group = FindIn(1, 0, leaves, goal, groupCount, length);
+    if (group < 0)
+        group = FindIn(1, 0, leaves, 0, goal, length);
+    return group;
+}
+
+uint32_t FreeSpaceIndex::LongestRun(uint32_t group)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return tree[leaves + group];
+}
+
+uint32_t FreeSpaceIndex::RunStart(uint32_t group)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return runStart[group];
+}
+
+bool FreeSpaceIndex::IsExact(uint32_t group)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return exact[group];
+}
@@ -0,0 +1,43 @@
+#ifndef OS_PROJECT_FREESPACEINDEX_H
+#define OS_PROJECT_FREESPACEINDEX_H
+
+#include <cstdint>
+#include <mutex>
+
+// In-memory summary of where free space is: the longest free run of every
+// group, under a max tree so the group nearest a goal with a run of a given
+// length is found in O(log groups) without reading any bitmap.
+//
+// A group's run starts out as its free block count, an upper bound that costs
+// no I/O to build. It becomes exact once the allocator has looked at the
+// group's bitmap, so a group is never scanned twice for a run it lacks.
+// Every call takes the index's lock, so allocators in different groups share it.
+class FreeSpaceIndex
+{
+private:
+    uint32_t groupCount;
+    uint32_t leaves;            // groupCount rounded up to a power of two
+    uint32_t *tree;             // tree[1] is the root; leaf g is tree[leaves + g]
+    uint32_t *runStart;         // Bit where the group's longest run starts, once exact
+    bool *exact;
+    std::mutex lock;
+
+    int32_t FindIn(uint32_t node, uint32_t low, uint32_t high, uint32_t first, uint32_t last, uint32_t length);
+public:
+    // freeBlocks holds each group's free count, from the block group descriptors
+    void Init(uint32_t groups, const uint32_t *freeBlocks);
+    void Destroy();
+
+    // Records the longest free run of the group, measured from its bitmap
+    void Update(uint32_t group, uint32_t start, uint32_t longestRun);
+
+    // The first group from goal onwards, wrapping round, that may hold a free
+    // run of length blocks, or -1 when none can
+    int32_t Find(uint32_t goal, uint32_t length);
+
+    uint32_t LongestRun(uint32_t group);
+    uint32_t RunStart(uint32_t group);
+    bool IsExact(uint32_t group);
+};
+
+#endif
@@ -1,5 +1,7 @@
  #include <cstdint>
+#include <cstring>
 #include "Inodes.h"
+#include "../step-3/Bitmap.h"
 #include <iostream>
 
  Inodes::Inodes(Ext2File *f)
@@ -9,15 +11,11 @@
 
  bool Inodes::SetGroupDesc(Ext2File *f)
 {
-    uint32_t totalBG = (f->superblock->blocksCount + f->superblock->blocksPerGroup - 1) / f->superblock->blocksPerGroup;
-
-    groupDesc = new BlockGroupDescriptor[totalBG];
-
-    uint32_t bgdtBlock = f->superblock->firstDataBlock + 1;
-    if (!f->FetchBGDT(bgdtBlock, groupDesc))
+    // Shares the filesystem's resident table so both always see the same counts
+    groupDesc = f->groupDesc;
+    if (!groupDesc)
     {
         std::cerr << "Failed to fetch BGDT\n";
-        delete[] groupDesc;
         return false;
     }
     return true;
@@ -70,6 +68,9 @@ bool Inodes::WriteInode(Ext2File* f, uint32_t iNum, Inode* buf)
     uint32_t blockOffset = localIndex / inodesPerBlock;
     uint32_t targetBlock = tableStart + blockOffset;
 
+    // Inodes sharing a table block are written under their group's lock, so
+    // no writer's read-modify-write loses another's
+    std::lock_guard<std::mutex> lock(f->GroupLock(group));
     uint8_t *tmp = new uint8_t[blockSize];
     if (!f->FetchBlock(targetBlock, tmp))
     {
@@ -90,6 +91,20 @@ bool Inodes::WriteInode(Ext2File* f, uint32_t iNum, Inode* buf)
     return true;
 }
 
+ uint64_t Inodes::FileSize(Inode *inode)
+ {
+     if ((inode->mode & 0xF000) == 0x8000)
+         return (static_cast<uint64_t>(inode->dirAcl) << 32) | inode->size;
+     return inode->size;
+ }
+
+ void Inodes::SetFileSize(Inode *inode, uint64_t size)
+ {
+     inode->size = static_cast<uint32_t>(size);
+     if ((inode->mode & 0xF000) == 0x8000)
+         inode->dirAcl = static_cast<uint32_t>(size >> 32);
+ }
+
  bool Inodes::InodeInUse(Ext2File* f, uint32_t iNum)
  {
      if (iNum == 0 || iNum > f->superblock->inodesCount)
@@ -121,7 +136,10 @@ bool Inodes::WriteInode(Ext2File* f, uint32_t iNum, Inode* buf)
  {
      uint32_t inodesPerGroup = f->superblock->inodesPerGroup;
      uint32_t blockSize = 1024 << f->superblock->logBlockSize;
+     if (group < 0)
+         group = f->HomeGroup();
 
+     std::lock_guard<std::mutex> lock(f->GroupLock(group));
      uint8_t *buf= new uint8_t[blockSize];
      if (!f->FetchBlock(groupDesc[group].inodeBitmap, buf))
      {
@@ -129,40 +147,14 @@ bool Inodes::WriteInode(Ext2File* f, uint32_t iNum, Inode* buf)
          return -1;
      }
 
-     bool allocated = false;
-     uint32_t newIno = 0;
-     uint32_t bytes = (inodesPerGroup + 7) / 8;
-
-     for (uint32_t b = 0; b < bytes; ++b)
-     {
-         if (allocated)
-             break;
-
-         if (buf[b] != 0xFF)
-         {
-             for (int bit = 0; bit < 8; ++bit)
-             {
-                 uint32_t idx = b * 8 + bit;
-
-                 if (idx >= inodesPerGroup)
-                     break;
-
-                 if (!(buf[b] & (1u << bit)))
-                 {
-                     buf[b] |= (1u << bit);
-                     newIno = group * inodesPerGroup + idx + 1;
-                     allocated = true;
-                     break;
-                 }
-             }
-         }
-     }
-
-     if (!allocated)
+     uint32_t idx = BitmapFindZero(buf, 0, inodesPerGroup);
+     if (idx == inodesPerGroup)
      {
          delete[] buf;
          return -1;
      }
+     BitmapSet(buf, idx, 1);
+     uint32_t newIno = group * inodesPerGroup + idx + 1;
 
      if (!f->WriteBlock(groupDesc[group].inodeBitmap, buf))
      {
@@ -170,14 +162,8 @@ bool Inodes::WriteInode(Ext2File* f, uint32_t iNum, Inode* buf)
          return -1;
      }
 
-     f->superblock->freeInodesCount--;
      groupDesc[group].freeInodesCount--;
-     f->WriteSuperBlock(f->superblock->firstDataBlock, f->superblock);
-
-     uint32_t descsPerBlock = blockSize / sizeof(BlockGroupDescriptor);
-     uint32_t bgdtBlock = f->superblock->firstDataBlock + 1 + (group / descsPerBlock);
-
-     f->WriteBGDT(bgdtBlock,&groupDesc[(group / descsPerBlock) * descsPerBlock]);
+     f->MarkGroupDirty(group);
 
      delete[] buf;
      return static_cast<int32_t>(newIno);
@@ -195,6 +181,7 @@ bool Inodes::WriteInode(Ext2File* f, uint32_t iNum, Inode* buf)
      uint32_t blockSize = 1024 << f->superblock->logBlockSize;
      uint32_t bitmapBlockNum = groupDesc[group].inodeBitmap;
 
+     std::lock_guard<std::mutex> lock(f->GroupLock(group));
      uint8_t *buf= new uint8_t[blockSize];
      if (!f->FetchBlock(bitmapBlockNum, buf))
      {
@@ -202,10 +189,13 @@ bool Inodes::WriteInode(Ext2File* f, uint32_t iNum, Inode* buf)
          return false;
      }
 
-     uint32_t byteOff = localIndex / 8;
-     uint32_t bitOff = localIndex % 8;
-
-     buf[byteOff] &= ~(1u << bitOff);
+     // An inode that is already free must not be counted twice
+     if (!BitmapTest(buf, localIndex))
+     {
+         delete[] buf;
+         return false;
+     }
+     BitmapClear(buf, localIndex, 1);
 
      if (!f->WriteBlock(bitmapBlockNum, buf))
      {
@@ -213,10 +203,8 @@ bool Inodes::WriteInode(Ext2File* f, uint32_t iNum, Inode* buf)
          return false;
      }
 
-     f->superblock->freeInodesCount++;
      groupDesc[group].freeInodesCount++;
-     f->WriteSuperBlock(f->superblock->firstDataBlock, f->superblock);
-     f->WriteBGDT(f->superblock->firstDataBlock + 1, groupDesc);
+     f->MarkGroupDirty(group);
 
      delete[] buf;
      return true;
@@ -32,7 +32,7 @@ struct Inode
 class Inodes
 {
 public:
-    BlockGroupDescriptor *groupDesc;
+    BlockGroupDescriptor *groupDesc;    // The Ext2File's resident table, not a copy
 
     bool SetGroupDesc(Ext2File *f);
 
@@ -41,7 +41,12 @@ public:
     bool FetchInode(Ext2File *f, uint32_t iNum, Inode *buf);
     bool WriteInode(Ext2File* f, uint32_t iNum, Inode* buf);
 
+    // Regular files keep the high 32 bits of their size in dirAcl
+    static uint64_t FileSize(Inode *inode);
+    static void SetFileSize(Inode *inode, uint64_t size);
+
     bool InodeInUse(Ext2File* f, uint32_t iNum);
+    // A group of -1 allocates in the calling thread's home group
     int32_t AllocateInode(Ext2File* f, int32_t group);
     bool FreeInode(Ext2File* f, uint32_t iNum);
 };
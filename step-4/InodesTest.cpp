@@ -35,7 +35,7 @@ void DisplayInode(uint32_t inodeNum, Inode *inode)
 {
     printf("Inode: %u\n", inodeNum );
     printf("Mode: %u - %s\n", inode->mode, FormatMode(inode->mode).c_str());
-    printf("Size: %u\n", inode->size);
+    printf("Size: %llu\n", static_cast<unsigned long long>(Inodes::FileSize(inode)));
     printf("Blocks: %u\n", inode->blocks);
     printf("UID/GID: %u / %u\n", inode->uid, inode->gid);
     printf("Links: %u\n", inode->linksCount);
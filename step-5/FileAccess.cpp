@@ -1,5 +1,6 @@
 #include <iostream>
 #include <cstdint>
+#include <cstring>
 #include <fcntl.h>
 #include "../step-3/Ext2File.h"
 #include "../step-4/Inodes.h"
@@ -93,7 +94,7 @@ void DisplayInode(uint32_t inodeNum, Inode *inode)
 {
     printf("Inode: %u\n", inodeNum );
     printf("Mode: %u - %s\n", inode->mode, FormatMode(inode->mode).c_str());
-    printf("Size: %u\n", inode->size);
+    printf("Size: %llu\n", static_cast<unsigned long long>(Inodes::FileSize(inode)));
     printf("Blocks: %u\n", inode->blocks);
     printf("UID/GID: %u / %u\n", inode->uid, inode->gid);
     printf("Links: %u\n", inode->linksCount);
@@ -118,91 +119,145 @@ void DisplayInode(uint32_t inodeNum, Inode *inode)
     printf("Triple indirect block: %u\n", inode->block[14]);
 }
 
-bool ResolveBlockPointerRaw(Ext2File *f, Inodes *inodes, uint32_t iNum, Inode *inode, uint32_t bNum, uint8_t *scratch, bool allocate, uint32_t &outBlock)
+// Blocks for a write: taken from extents reserved up front while they last,
+// then allocated one at a time after the last block handed out
+struct BlockSource
+{
+    std::vector<BlockExtent> extents;
+    size_t next;
+    uint32_t goal;
+};
+
+uint32_t TakeBlock(Ext2File *f, BlockSource *source)
+{
+    while (source->next < source->extents.size() && source->extents[source->next].count == 0)
+        source->next++;
+
+    uint32_t block;
+    if (source->next < source->extents.size())
+    {
+        BlockExtent &extent = source->extents[source->next];
+        block = extent.start++;
+        extent.count--;
+    }
+    else
+    {
+        block = f->AllocateBlock(source->goal);
+    }
+
+    if (block != 0)
+        source->goal = block + 1;
+    return block;
+}
+
+// Blocks are read and never allocated when source is nullptr
+bool ResolveBlockPointerRaw(Ext2File *f, Inodes *inodes, uint32_t iNum, Inode *inode, uint32_t bNum, uint8_t *scratch, BlockSource *source, uint32_t &outBlock)
 {
     uint32_t blockSize = 1024u << f->superblock->logBlockSize;
-    uint32_t k = blockSize / sizeof(uint32_t);
+    uint64_t k = blockSize / sizeof(uint32_t);
 
+    // Pick the inode slot and the index path through the indirect blocks
     int depth;
-    uint32_t index0 = 0;
-    uint32_t index1 = 0;
-    uint32_t index2 = 0;
+    uint32_t slot;
+    uint32_t indices[3] = { 0, 0, 0 };
+    uint64_t rem = bNum;
 
-    if (bNum < 12)
+    if (rem < 12)
     {
         depth = 0;
-        index0 = bNum;
+        slot = rem;
     }
-    else if (bNum < 12 + k)
+    else if ((rem -= 12) < k)
     {
         depth = 1;
-        index0 = bNum - 12;
-        index1 = index0;
+        slot = 12;
+        indices[0] = rem;
     }
-    else if (bNum < 12 + k + k*k)
+    else if ((rem -= k) < k * k)
     {
         depth = 2;
-        uint32_t rem = bNum - 12;
-        index1 = rem / k;
-        index0 = rem % k;
+        slot = 13;
+        indices[0] = rem / k;
+        indices[1] = rem % k;
     }
     else
     {
+        rem -= k * k;
+        if (rem >= k * k * k)
+            return false;
         depth = 3;
-        uint32_t rem = bNum - 12 - k;
-        index2 = rem / (k * k);
-        rem  = rem % (k*k);
-        index1 = rem / k;
-        index0 = rem % k;
+        slot = 14;
+        indices[0] = rem / (k * k);
+        indices[1] = (rem / k) % k;
+        indices[2] = rem % k;
     }
 
-    uint32_t *ptrs[4] = { nullptr, nullptr, nullptr, nullptr };
+    uint32_t block = inode->block[slot];
+    bool inodeChanged = false;
 
-    if (depth == 0)
-        ptrs[0] = &inode->block[index0];
-    else
-        ptrs[0] = &inode->block[12];
+    if (block == 0)
+    {
+        if (!source)
+            return false;
 
-    if (depth >= 1)
-        ptrs[1] = &inode->block[12];
-    if (depth >= 2)
-        ptrs[2] = &inode->block[13];
-    if (depth >= 3)
-        ptrs[3] = &inode->block[14];
+        block = TakeBlock(f, source);
+        if (block == 0)
+            return false;
+        inode->block[slot] = block;
+        inode->blocks += blockSize / 512;
+        inodeChanged = true;
 
-    uint32_t indices[4] = {index0, index1, index2, 0 };
+        if (depth > 0)
+        {
+            memset(scratch, 0, blockSize);
+            if (!f->WriteBlock(block, scratch))
+                return false;
+        }
+    }
+    else if (depth > 0 && !f->FetchBlock(block, scratch))
+    {
+        return false;
+    }
 
-    for (int lvl = 0; lvl <= depth; lvl++)
+    // scratch always holds the indirect block we are currently standing on
+    for (int lvl = 0; lvl < depth; lvl++)
     {
-        if (*ptrs[lvl] == 0)
+        uint32_t *array = reinterpret_cast<uint32_t*>(scratch);
+        uint32_t next = array[indices[lvl]];
+
+        if (next == 0)
         {
-            if (!allocate)
+            if (!source)
                 return false;
 
-            *ptrs[lvl] = f->AllocateBlock();
-            if (*ptrs[lvl] == 0)
+            next = TakeBlock(f, source);
+            if (next == 0)
                 return false;
+            inode->blocks += blockSize / 512;
+            inodeChanged = true;
 
-            if (lvl > 0)
+            array[indices[lvl]] = next;
+            if (!f->WriteBlock(block, scratch))
+                return false;
+
+            if (lvl + 1 < depth)
             {
                 memset(scratch, 0, blockSize);
-                f->WriteBlock(*ptrs[lvl], scratch);
+                if (!f->WriteBlock(next, scratch))
+                    return false;
             }
         }
-
-        if (lvl == depth) {
-            outBlock = *ptrs[lvl];
-            break;
-        }
-
-        if (!f->FetchBlock(*ptrs[lvl], scratch))
+        else if (lvl + 1 < depth && !f->FetchBlock(next, scratch))
+        {
             return false;
+        }
 
-        uint32_t* array = reinterpret_cast<uint32_t*>(scratch);
-        ptrs[lvl+1] = &array[ indices[lvl+1] ];
+        block = next;
     }
 
-    if (allocate)
+    outBlock = block;
+
+    if (inodeChanged)
         inodes->WriteInode(f, iNum, inode);
 
     return true;
@@ -214,7 +269,7 @@ bool FetchBlockFromFile(Ext2File *f, Inode *i, uint32_t bNum, void *buf)
     uint8_t* scratch = new uint8_t[blockSize];
     uint32_t physBlock = 0;
 
-    bool result = ResolveBlockPointerRaw(f, nullptr, 0, i, bNum, scratch, false, physBlock);
+    bool result = ResolveBlockPointerRaw(f, nullptr, 0, i, bNum, scratch, nullptr, physBlock);
 
     if (result)
         result = f->FetchBlock(physBlock, buf);
@@ -223,13 +278,66 @@ bool FetchBlockFromFile(Ext2File *f, Inode *i, uint32_t bNum, void *buf)
     return result;
 }
 
+// Reads count consecutive file blocks, issuing one read per physically contiguous run
+bool FetchBlocksFromFile(Ext2File *f, Inode *i, uint32_t bNum, uint32_t count, void *buf)
+{
+    uint32_t blockSize = 1024u << f->superblock->logBlockSize;
+    uint8_t *scratch = new uint8_t[blockSize];
+    uint8_t *out = reinterpret_cast<uint8_t*>(buf);
+
+    uint32_t runStart = 0;
+    uint32_t runLength = 0;
+    bool result = true;
+
+    for (uint32_t n = 0; n < count && result; n++)
+    {
+        uint32_t physBlock = 0;
+        result = ResolveBlockPointerRaw(f, nullptr, 0, i, bNum + n, scratch, nullptr, physBlock);
+        if (!result)
+            break;
+
+        if (runLength > 0 && physBlock == runStart + runLength)
+        {
+            runLength++;
+            continue;
+        }
+
+        if (runLength > 0)
+        {
+            result = f->FetchBlocks(runStart, runLength, out);
+            out += static_cast<size_t>(runLength) * blockSize;
+        }
+        runStart = physBlock;
+        runLength = 1;
+    }
+
+    if (result && runLength > 0)
+        result = f->FetchBlocks(runStart, runLength, out);
+
+    delete[] scratch;
+    return result;
+}
+
+// Where a new block of the file should go: right after the block before it,
+// or at the start of the inode's group for the first block
+uint32_t BlockGoal(Ext2File *f, uint32_t iNum, Inode *i, uint32_t bNum, uint8_t *scratch)
+{
+    uint32_t previous = 0;
+    if (bNum > 0 && ResolveBlockPointerRaw(f, nullptr, 0, i, bNum - 1, scratch, nullptr, previous))
+        return previous + 1;
+
+    uint32_t group = (iNum - 1) / f->superblock->inodesPerGroup;
+    return group * f->superblock->blocksPerGroup + f->superblock->firstDataBlock;
+}
+
 bool WriteBlockToFile(Ext2File *f, Inodes *inodes, uint32_t iNum, Inode *i, uint32_t bNum, void *buf)
 {
     uint32_t blockSize = 1024u << f->superblock->logBlockSize;
     uint8_t *scratch = new uint8_t[blockSize];
     uint32_t physBlock = 0;
 
-    bool result = ResolveBlockPointerRaw(f, inodes, iNum, i, bNum, scratch, true, physBlock);
+    BlockSource source = {{}, 0, BlockGoal(f, iNum, i, bNum, scratch)};
+    bool result = ResolveBlockPointerRaw(f, inodes, iNum, i, bNum, scratch, &source, physBlock);
 
     if (result)
         result = f->WriteBlock(physBlock, buf);
@@ -238,12 +346,79 @@ bool WriteBlockToFile(Ext2File *f, Inodes *inodes, uint32_t iNum, Inode *i, uint
     return result;
 }
 
+// Writes count consecutive file blocks. The holes among them are reserved as
+// one allocation so the file stays contiguous, and each physically contiguous
+// run is written with one call.
+bool WriteBlocksToFile(Ext2File *f, Inodes *inodes, uint32_t iNum, Inode *i, uint32_t bNum, uint32_t count, void *buf)
+{
+    uint32_t blockSize = 1024u << f->superblock->logBlockSize;
+    uint32_t k = blockSize / sizeof(uint32_t);
+    uint8_t *scratch = new uint8_t[blockSize];
+    uint8_t *in = reinterpret_cast<uint8_t*>(buf);
+
+    uint32_t missing = 0;
+    for (uint32_t n = 0; n < count; n++)
+    {
+        uint32_t physBlock = 0;
+        if (!ResolveBlockPointerRaw(f, nullptr, 0, i, bNum + n, scratch, nullptr, physBlock))
+            missing++;
+    }
+
+    // Room for the indirect blocks the holes may need, which are taken in line with the data
+    BlockSource source = {{}, 0, BlockGoal(f, iNum, i, bNum, scratch)};
+    if (missing > 0)
+        f->AllocateBlocks(missing + missing / k + 2, source.goal, source.extents);
+
+    uint32_t runStart = 0;
+    uint32_t runLength = 0;
+    bool result = true;
+
+    for (uint32_t n = 0; n < count && result; n++)
+    {
+        uint32_t physBlock = 0;
+        result = ResolveBlockPointerRaw(f, inodes, iNum, i, bNum + n, scratch, &source, physBlock);
+        if (!result)
+            break;
+
+        if (runLength > 0 && physBlock == runStart + runLength)
+        {
+            runLength++;
+            continue;
+        }
+
+        if (runLength > 0)
+        {
+            result = f->WriteBlocks(runStart, runLength, in);
+            in += static_cast<size_t>(runLength) * blockSize;
+        }
+        runStart = physBlock;
+        runLength = 1;
+    }
+
+    if (result && runLength > 0)
+        result = f->WriteBlocks(runStart, runLength, in);
+
+    // Give back whatever the indirect blocks did not use
+    for (size_t e = source.next; e < source.extents.size(); e++)
+    {
+        if (source.extents[e].count > 0)
+            f->FreeBlocks(source.extents[e].start, source.extents[e].count);
+    }
+
+    delete[] scratch;
+    return result;
+}
+
 int main()
 {
     char filename[] = "c:/dev/cpp/OS-project/vdi-files/good-dynamic-1k.vdi";
     Ext2File *extFile = new Ext2File;
     if (!extFile->Open(filename))
         return -1;
+    // Files are read one block at a time below; let the partition stream ahead
+    extFile->mbrPart->EnableReadAhead();
+    // Inode tables, bitmaps and indirect blocks are fetched over and over
+    extFile->EnableCache();
 
     uint32_t inodeNum = 2; // root dir
     Inodes *inodes = new Inodes(extFile);